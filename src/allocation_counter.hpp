@@ -0,0 +1,64 @@
+#pragma once
+
+// Replaces the global operator new and delete with malloc() and free() and
+// counts every allocation, include it in one translation unit per program
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace jc {
+
+inline std::atomic<std::size_t> global_allocations = 0;
+
+// noinline keeps GCC from pairing an inlined malloc() with operator delete
+[[gnu::noinline]] inline void* CountedMalloc(std::size_t size) noexcept {
+  ++global_allocations;
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+}  // namespace jc
+
+[[gnu::noinline]] void* operator new(std::size_t size) {
+  if (void* p = jc::CountedMalloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+[[gnu::noinline]] void* operator new(std::size_t size,
+                                     const std::nothrow_t&) noexcept {
+  return jc::CountedMalloc(size);
+}
+
+[[gnu::noinline]] void* operator new[](std::size_t size,
+                                       const std::nothrow_t&) noexcept {
+  return jc::CountedMalloc(size);
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+
+[[gnu::noinline]] void operator delete[](void* p) noexcept { std::free(p); }
+
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p,
+                                       const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void* p,
+                                         const std::nothrow_t&) noexcept {
+  std::free(p);
+}
@@ -1,348 +1,100 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <map>
 #include <memory>
-#include <queue>
-#include <set>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
-namespace jc {
+#include "allocation_counter.hpp"
+#include "dag_graph.hpp"
+#include "thread_pool.hpp"
 
-template <typename K, typename V>
-struct DAGNode {
-  K k;
-  V v;
-  std::set<DAGNode<K, V>*> in;
-  std::set<DAGNode<K, V>*> out;
-};
+namespace jc::test {
 
-template <typename K, typename V>
-class DAGGraph {
+class MockPipelineEngine {
  public:
-  bool AddEdge(const K& from, const K& to);
-
-  V& operator[](const K& key);
-
-  bool Exist(const K& key) const;
-
-  void Clear();
-
-  std::size_t Size() const;
-
-  void Walk(std::function<void(const K& k, const V& v)> f,
-            bool start_from_head = true);
-
-  void WalkHeads(std::function<void(const K& k, const V& v)> f);
-
-  void WalkTails(std::function<void(const K& k, const V& v)> f);
-
-  std::unordered_set<K> NextKeys();
-
-  std::unordered_set<K> NextKeys(const K& key);
-
- private:
-  bool IsCyclic(const DAGNode<K, V>& from, const DAGNode<K, V>& to) const;
-
-  void RefreshWalkSequences();
-
-  std::vector<std::set<K>> ConnectedComponents() const;
-
-  void DFS(const K& k, std::unordered_set<K>* visited,
-           std::set<K>* connected_components) const;
-
-  std::vector<K> TopologicalSequence(const std::set<K>& connected_components,
-                                     bool start_from_head) const;
-
- private:
-  std::map<K, DAGNode<K, V>> bucket_;
-  std::unordered_set<K> heads_;
-  std::unordered_set<K> tails_;
-  std::vector<std::vector<K>> sequences_start_from_head_;
-  std::vector<std::vector<K>> sequences_start_from_tail_;
-
- private:
-  bool allow_modify_ = true;
-  std::vector<std::vector<K>> sequences_start_from_head_for_next_;
-  std::unordered_set<K> current_heads_for_next_;
+  void Start() {}
+  void Stop() {}
+  void Destroy() {}
 };
 
-template <typename K, typename V>
-inline bool DAGGraph<K, V>::AddEdge(const K& from, const K& to) {
-  assert(allow_modify_);
-  if (from == to || !bucket_.count(from) || !bucket_.count(to) ||
-      IsCyclic(bucket_.at(from), bucket_.at(to))) {
-    return false;
-  }
-  bucket_.at(from).out.emplace(&bucket_.at(to));
-  bucket_.at(to).in.emplace(&bucket_.at(from));
-  heads_.erase(to);
-  tails_.erase(from);
-  sequences_start_from_head_.clear();
-  sequences_start_from_tail_.clear();
-  return true;
-}
-
-template <typename K, typename V>
-inline V& DAGGraph<K, V>::operator[](const K& key) {
-  if (!bucket_.count(key)) {
-    assert(allow_modify_);
-    bucket_[key].k = key;
-    heads_.emplace(key);
-    tails_.emplace(key);
-    sequences_start_from_head_.clear();
-    sequences_start_from_tail_.clear();
-  }
-  return bucket_.at(key).v;
-}
-
-template <typename K, typename V>
-inline bool DAGGraph<K, V>::Exist(const K& key) const {
-  return bucket_.count(key);
-}
-
-template <typename K, typename V>
-inline void DAGGraph<K, V>::Clear() {
-  allow_modify_ = true;
-  bucket_.clear();
-  heads_.clear();
-  tails_.clear();
-  sequences_start_from_head_.clear();
-  sequences_start_from_tail_.clear();
-}
-
-template <typename K, typename V>
-inline std::size_t DAGGraph<K, V>::Size() const {
-  return bucket_.size();
-}
+// Runs each task on the submitting thread
+struct InlineExecutor {
+  void Submit(std::function<void()> f) { f(); }
+};
 
-template <typename K, typename V>
-inline void DAGGraph<K, V>::Walk(std::function<void(const K& k, const V& v)> f,
-                                 bool start_from_head) {
-  if (sequences_start_from_head_.empty()) {
-    RefreshWalkSequences();
-  }
-  const std::vector<std::vector<K>>& seqs_to_walk =
-      start_from_head ? sequences_start_from_head_ : sequences_start_from_tail_;
-  for (const std::vector<K>& seq : seqs_to_walk) {
-    std::for_each(std::begin(seq), std::end(seq), [&](const K& key) {
-      const DAGNode<K, V>& node = bucket_.at(key);
-      f(node.k, node.v);
-    });
-  }
-}
+enum class GraphShape {
+  kLayered,
+  kWideFanOut,
+  kDeepChain,
+  kSmallComponents,
+};
 
-template <typename K, typename V>
-inline void DAGGraph<K, V>::WalkHeads(
-    std::function<void(const K& k, const V& v)> f) {
-  if (sequences_start_from_head_.empty()) {
-    RefreshWalkSequences();
-  }
-  for (const std::vector<K>& seq : sequences_start_from_head_) {
-    std::for_each(std::begin(seq), std::end(seq), [&](const K& key) {
-      if (heads_.count(key)) {
-        const DAGNode<K, V>& node = bucket_.at(key);
-        f(node.k, node.v);
+// Random DAG of n nodes, edges always lead from a lower key to a higher one
+inline std::vector<std::pair<int, int>> MakeEdges(GraphShape shape, int n,
+                                                  std::uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<std::pair<int, int>> edges;
+  switch (shape) {
+    case GraphShape::kLayered: {
+      // layers of 64 nodes, each node fed by up to 3 nodes of the layer above
+      constexpr int width = 64;
+      for (int to = width; to < n; ++to) {
+        const int layer = to / width * width;
+        for (int i = 0; i < 3; ++i) {
+          edges.emplace_back(layer - width + rng() % width, to);
+        }
       }
-    });
-  }
-}
-
-template <typename K, typename V>
-inline void DAGGraph<K, V>::WalkTails(
-    std::function<void(const K& k, const V& v)> f) {
-  if (sequences_start_from_head_.empty()) {
-    RefreshWalkSequences();
-  }
-  for (const std::vector<K>& seq : sequences_start_from_tail_) {
-    std::for_each(std::begin(seq), std::end(seq), [&](const K& key) {
-      if (tails_.count(key)) {
-        const DAGNode<K, V>& node = bucket_.at(key);
-        f(node.k, node.v);
+      break;
+    }
+    case GraphShape::kWideFanOut:
+      // a few roots feeding everything else
+      for (int to = 8; to < n; ++to) {
+        edges.emplace_back(rng() % 8, to);
       }
-    });
-  }
-}
-
-template <typename K, typename V>
-inline std::unordered_set<K> DAGGraph<K, V>::NextKeys() {
-  assert(allow_modify_);  // allowed call once unless Clear()
-  allow_modify_ = false;
-  current_heads_for_next_ = heads_;
-  if (sequences_start_from_head_.empty()) {
-    RefreshWalkSequences();
-  }
-  return heads_;
-}
-
-template <typename K, typename V>
-inline std::unordered_set<K> DAGGraph<K, V>::NextKeys(const K& key) {
-  assert(!allow_modify_);  // must call NextKeys() before
-  assert(current_heads_for_next_.count(key));
-  current_heads_for_next_.erase(key);
-
-  std::unordered_set<K> res;
-  for (std::vector<K>& seq : sequences_start_from_head_for_next_) {
-    auto it = std::find(begin(seq), std::end(seq), key);
-    if (it == std::end(seq)) {
-      continue;
-    }
-    seq.erase(it);
-    const std::set<DAGNode<K, V>*>& nodes = bucket_.at(key).out;
-    for (DAGNode<K, V>* v : nodes) {
-      const std::set<DAGNode<K, V>*>& prev_nodes = v->in;
-      bool no_prev_node_in_seq =
-          std::all_of(std::begin(prev_nodes), std::end(prev_nodes),
-                      [&](DAGNode<K, V>* in_node) {
-                        return std::find(std::begin(seq), std::end(seq),
-                                         in_node->k) == std::end(seq);
-                      });
-      if (no_prev_node_in_seq) {
-        current_heads_for_next_.emplace(v->k);
-        res.emplace(v->k);
+      break;
+    case GraphShape::kDeepChain:
+      // one chain with random forward shortcuts
+      for (int to = 1; to < n; ++to) {
+        edges.emplace_back(to - 1, to);
+        if (to % 16 == 0) {
+          edges.emplace_back(rng() % to, to);
+        }
       }
-    }
-    break;
-  }
-  return res;
-}
-
-template <typename K, typename V>
-inline bool DAGGraph<K, V>::IsCyclic(const DAGNode<K, V>& from,
-                                     const DAGNode<K, V>& to) const {
-  std::queue<DAGNode<K, V>*> q;
-  for (DAGNode<K, V>* v : from.in) {
-    q.emplace(v);
-  }
-
-  std::unordered_set<DAGNode<K, V>*> visited;
-  while (!q.empty()) {
-    DAGNode<K, V>* node = q.front();
-    q.pop();
-    if (visited.count(node)) {
-      continue;
-    }
-    if (node == &to) {
-      return true;
-    }
-    visited.emplace(node);
-    for (DAGNode<K, V>* v : node->in) {
-      q.emplace(v);
-    }
-  }
-
-  return false;
-}
-
-template <typename K, typename V>
-inline void DAGGraph<K, V>::RefreshWalkSequences() {
-  sequences_start_from_head_.clear();
-  sequences_start_from_tail_.clear();
-
-  const std::vector<std::set<K>> connected_components = ConnectedComponents();
-  for (const std::set<K>& x : connected_components) {
-    const std::vector<K> seq_from_head = TopologicalSequence(x, true);
-    const std::vector<K> seq_from_tail = TopologicalSequence(x, false);
-    assert(!seq_from_head.empty());
-    assert(!seq_from_tail.empty());
-    sequences_start_from_head_.emplace_back(seq_from_head);
-    sequences_start_from_tail_.emplace_back(seq_from_tail);
-  }
-
-  sequences_start_from_head_for_next_ = sequences_start_from_head_;
-}
-
-template <typename K, typename V>
-inline std::vector<std::set<K>> DAGGraph<K, V>::ConnectedComponents() const {
-  std::vector<std::set<K>> res;
-  std::unordered_set<K> visited;
-  for (auto& x : bucket_) {
-    std::set<K> tmp;
-    DFS(x.second.k, &visited, &tmp);
-    if (!tmp.empty()) {
-      res.emplace_back(tmp);
-    }
-  }
-  std::sort(std::begin(res), std::end(res),
-            [&](const std::set<K>& lhs, const std::set<K>& rhs) {
-              return lhs.size() < rhs.size();
-            });
-  return res;
-}
-
-template <typename K, typename V>
-inline void DAGGraph<K, V>::DFS(const K& k, std::unordered_set<K>* visited,
-                                std::set<K>* connected_components) const {
-  if (visited->count(k)) {
-    return;
-  }
-  visited->emplace(k);
-  connected_components->emplace(k);
-  if (!bucket_.at(k).in.empty()) {
-    for (DAGNode<K, V>* v : bucket_.at(k).in) {
-      DFS(v->k, visited, connected_components);
-    }
-  }
-  if (!bucket_.at(k).out.empty()) {
-    for (DAGNode<K, V>* v : bucket_.at(k).out) {
-      DFS(v->k, visited, connected_components);
-    }
-  }
-}
-
-template <typename K, typename V>
-inline std::vector<K> DAGGraph<K, V>::TopologicalSequence(
-    const std::set<K>& connected_components, bool start_from_head) const {
-  std::map<K, std::vector<K>> adjacency_list;
-  std::map<K, int32_t> in_degree;
-
-  for (const K& key : connected_components) {
-    if (!in_degree.count(key)) {
-      in_degree.emplace(key, 0);
-    }
-    const std::set<DAGNode<K, V>*>& nodes =
-        start_from_head ? bucket_.at(key).out : bucket_.at(key).in;
-    for (DAGNode<K, V>* v : nodes) {
-      adjacency_list[key].emplace_back(v->k);
-      ++in_degree[v->k];
-    }
-  }
-
-  std::queue<K> q;
-  for (auto& x : in_degree) {
-    if (x.second == 0) {
-      q.emplace(x.first);
-    }
-  }
-
-  std::vector<K> res;
-  while (!q.empty()) {
-    const K key = q.front();
-    q.pop();
-    res.emplace_back(key);
-    for (const K& k : adjacency_list[key]) {
-      if (--in_degree.at(k) == 0) {
-        q.emplace(k);
+      break;
+    case GraphShape::kSmallComponents:
+      // diamonds of 4 nodes with no edges between them
+      for (int base = 0; base + 3 < n; base += 4) {
+        edges.emplace_back(base, base + 1);
+        edges.emplace_back(base, base + 2);
+        edges.emplace_back(base + 1, base + 3);
+        edges.emplace_back(base + 2, base + 3);
       }
-    }
+      break;
   }
-
-  assert(res.size() == connected_components.size());  // graph is DAG
-  return res;
+  return edges;
 }
 
-}  // namespace jc
-
-namespace jc::test {
-
-class MockPipelineEngine {
- public:
-  void Start() {}
-  void Stop() {}
-  void Destroy() {}
-};
-
 void test() {
   DAGGraph<int, std::unique_ptr<MockPipelineEngine>> d;
   // Make Direct Acyclic Graph:
@@ -398,6 +150,263 @@ void test() {
   assert(!d.AddEdge(13, 13));
   assert(!d.AddEdge(13, 14));
 
+  {
+    // edges inserted against the insertion order force reordering
+    DAGGraph<int, int> g;
+    for (int i = 0; i < 5; ++i) {
+      g[i] = i;
+    }
+    assert(g.AddEdge(4, 3));
+    assert(g.AddEdge(3, 2));
+    assert(g.AddEdge(0, 1));
+    assert(g.AddEdge(2, 0));
+    assert(!g.AddEdge(1, 4));
+    assert(!g.AddEdge(0, 3));
+    assert(g.AddEdge(4, 1));
+    std::vector<int> v;
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{4, 3, 2, 0, 1}));
+
+    g.WalkMutable([](int, int& value) { value *= 10; });
+    std::function<void(const int&, const int&)> f = [&](int key, int value) {
+      assert(value == key * 10);
+      v.emplace_back(key);
+    };
+    v.clear();
+    g.Walk(f);
+    assert((v == std::vector<int>{4, 3, 2, 0, 1}));
+
+    // walks after small edits only rebuild the touched components
+    g[5] = 5;
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{5, 4, 3, 2, 0, 1}));
+    assert(g.AddEdge(1, 5));
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); }, false);
+    assert((v == std::vector<int>{5, 1, 0, 2, 3, 4}));
+  }
+
+  {
+    DAGGraph<int, int> g;
+    g.AddNodes(std::vector<int>{0, 1, 2, 3, 4, 5});
+    assert(g.Size() == 6);
+    assert(!g.AddEdges(std::vector<std::pair<int, int>>{{0, 1}, {1, 6}}));
+    assert(!g.AddEdges(std::vector<std::pair<int, int>>{{0, 1}, {3, 3}}));
+    assert(!g.AddEdges(
+        std::vector<std::pair<int, int>>{{0, 1}, {1, 2}, {2, 3}, {3, 0}}));
+    std::vector<int> v;
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{0, 1, 2, 3, 4, 5}));  // batch rejected
+    assert(g.AddEdges(
+        std::vector<std::pair<int, int>>{{5, 4}, {4, 3}, {3, 2}, {2, 1}}));
+    assert(!g.AddEdge(1, 5));
+    assert(g.AddEdge(0, 5));
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{0, 5, 4, 3, 2, 1}));
+
+    assert(g.RemoveEdge(4, 3));
+    assert(!g.RemoveEdge(4, 3));
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); }, false);
+    assert((v == std::vector<int>{4, 5, 0, 1, 2, 3}));
+    v.clear();
+    g.WalkHeads([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{0, 3}));
+
+    assert(g.RemoveNode(2));
+    assert(!g.Exist(2));
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{1, 3, 0, 5, 4}));
+
+    g[7] = 7;  // reuses the slot of 2
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{1, 7, 3, 0, 5, 4}));
+
+    DAGGraph<int, int> h = g.ExtractComponent(5);
+    assert(h.Size() == 3 && g.Size() == 3);
+    v.clear();
+    h.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{0, 5, 4}));
+    v.clear();
+    g.Walk([&](int key, int) { v.emplace_back(key); });
+    assert((v == std::vector<int>{1, 7, 3}));
+    assert(g.AddEdge(3, 1) && g.AddEdge(1, 7));
+  }
+
+  {
+    DAGGraph<int, int> g;
+    g.AddNodes(std::vector<int>{0, 1, 2, 3, 4});
+    assert(g.AddEdges(std::vector<std::pair<int, int>>{
+        {0, 1}, {1, 2}, {0, 2}, {2, 3}, {0, 3}, {1, 3}, {0, 4}}));
+    assert(g.Reachable(0, 3) && g.Reachable(2, 2) && !g.Reachable(4, 0));
+    g.TransitiveReduction();
+    assert(g.Reachable(0, 3) && !g.Reachable(4, 3));
+    assert(!g.RemoveEdge(0, 2) && !g.RemoveEdge(0, 3) && !g.RemoveEdge(1, 3));
+
+    g.EnableReachabilityIndex();
+    assert(g.Reachable(0, 3) && !g.Reachable(3, 0));
+    assert(!g.AddEdge(3, 0));  // rejected by the index
+    g[5] = 5;
+    assert(g.AddEdge(3, 5) && g.Reachable(0, 5) && !g.Reachable(4, 5));
+    assert(g.AddEdge(0, 5) && g.RemoveEdge(0, 5));  // implied by 0 -> 3
+    assert(g.RemoveEdge(1, 2) && !g.Reachable(0, 5) && g.Reachable(2, 5));
+  }
+
+  {
+    ArenaDAGGraph<int, int> g;
+    // nothing may fall back to the default resource or the global heap once
+    // the arena exists, scratch buffers included
+    std::pmr::memory_resource* default_resource =
+        std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    const std::size_t allocations = global_allocations;
+    for (int i = 0; i < 1000; ++i) {
+      g[i] = i;
+      assert(i == 0 || g.AddEdge(i - 1, i));
+    }
+    const std::pair<int, int> shortcuts[] = {{0, 2}, {10, 20}};
+    assert(g.AddEdges(shortcuts));
+    g.TransitiveReduction();
+    int levels = 0;
+    g.WalkLevels([&](std::span<const int> keys, std::span<int*>) {
+      assert(keys.size() == 1);
+      ++levels;
+    });
+    assert(levels == 1000);
+    assert(g.RemoveNode(500));
+    {
+      pmr::DAGGraph<int, int> h = g.ExtractComponent(0);
+      assert(h.get_allocator() == g.get_allocator());
+      int expected = 0;
+      h.Walk([&](int key, int v) { assert(key == v && key == expected++); });
+      assert(expected == 500);
+    }
+    g.Freeze();
+    int expected = 501;
+    g.Walk([&](int key, int) { assert(key == expected++); });
+    assert(expected == 1000 && global_allocations == allocations);
+    // the result is returned in a std::unordered_set
+    assert(g.NextKeys() == std::unordered_set<int>{501});
+    std::pmr::set_default_resource(default_resource);
+
+    ArenaDAGGraph<int, int, std::pmr::unsynchronized_pool_resource> p;
+    p[0] = p[1] = 0;
+    assert(p.AddEdge(0, 1) && p.RemoveNode(1) && p.Size() == 1);
+  }
+
+  {
+    // keys and values are built with the arena too, long pmr::string keys
+    // inserted, reused and extracted never reach the default resource
+    ArenaDAGGraph<std::pmr::string, std::pmr::string> g;
+    std::pmr::memory_resource* default_resource =
+        std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    const std::string prefix = "a key too long for small strings ";
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100; ++i) {
+      keys.emplace_back(prefix + std::to_string(i));
+    }
+    g.AddNodes(std::vector<std::string_view>(std::begin(keys),
+                                             std::begin(keys) + 50));
+    for (int i = 0; i < 100; ++i) {
+      g[std::string_view(keys[i])] = keys[i];
+      assert(i == 0 || g.AddEdge(std::string_view(keys[i - 1]),
+                                 std::string_view(keys[i])));
+    }
+    assert(g.RemoveNode(std::string_view(keys[50])));
+    g[prefix.c_str()] = prefix;
+    pmr::DAGGraph<std::pmr::string, std::pmr::string> h =
+        g.ExtractComponent(std::string_view(keys[0]));
+    int expected = 0;
+    h.Walk([&](const std::pmr::string& key, const std::pmr::string& v) {
+      assert(std::string_view(key) == keys[expected++] && v == key);
+    });
+    assert(expected == 50 && g.Size() == 50);
+    std::pmr::set_default_resource(default_resource);
+  }
+
+  {
+    // the hash index walks like the ordered one and finds string keys by
+    // std::string_view
+    DAGGraph<std::string, int> ordered;
+    DAGGraph<std::string, int, std::allocator<std::byte>, NullTracer,
+             FlatHashIndex>
+        hashed;
+    for (int i = 0; i < 100; ++i) {
+      ordered[std::to_string(i)] = hashed[std::to_string(i)] = i;
+    }
+    for (int i = 1; i < 100; ++i) {
+      const std::string from = std::to_string(i / 3);
+      const std::string to = std::to_string(i);
+      assert(ordered.AddEdge(from, to));
+      assert(hashed.AddEdge(std::string_view(from), std::string_view(to)));
+    }
+    for (int i = 0; i < 100; i += 7) {
+      assert(hashed.RemoveNode(std::string_view(std::to_string(i))));
+      assert(ordered.RemoveNode(std::to_string(i)));
+    }
+    assert(!hashed.Exist("0") && hashed.Exist("1") && hashed["1"] == 1);
+    assert(hashed.Reachable("1", "10") && !hashed.Reachable("10", "1"));
+    std::vector<std::string> lhs;
+    std::vector<std::string> rhs;
+    ordered.Walk([&](const std::string& key, int) { lhs.emplace_back(key); });
+    hashed.Walk([&](const std::string& key, int) { rhs.emplace_back(key); });
+    assert(lhs == rhs && lhs.size() == 85);
+  }
+
+  {
+    // heterogeneous lookups of long pmr::string keys must not allocate
+    std::pmr::monotonic_buffer_resource arena;
+    DAGGraph<std::pmr::string, int, std::pmr::polymorphic_allocator<std::byte>,
+             NullTracer, FlatHashIndex>
+        g(&arena);
+    const std::string prefix = "a key too long for small strings ";
+    for (int i = 0; i < 10; ++i) {
+      g[std::pmr::string(prefix + std::to_string(i), &arena)] = i;
+    }
+    std::pmr::memory_resource* default_resource =
+        std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    const std::string from = prefix + "0";
+    const std::string to = prefix + "9";
+    assert(g.AddEdge(std::string_view(from), std::string_view(to)));
+    assert(g.Reachable(std::string_view(from), std::string_view(to)));
+    assert(g[std::string_view(to)] == 9 && !g.Exist(std::string_view(prefix)));
+    assert(g.RemoveEdge(std::string_view(from), std::string_view(to)));
+    std::pmr::set_default_resource(default_resource);
+  }
+
+  {
+    // marks of removed nodes are dropped with them
+    DAGGraph<int, int> g;
+    for (int i = 0; i < 10; ++i) {
+      g[i] = i;
+      assert(i == 0 || g.AddEdge(i - 1, i));
+    }
+    assert(g.MarkDirty(5) && g.RemoveNode(5) && g.MarkDirty(7));
+    g[5] = 5;
+    std::vector<int> v;
+    g.WalkDirty([&](int key, int& value) {
+      value = -value;
+      v.emplace_back(key);
+    });
+    assert((v == std::vector<int>{7, 8, 9}) && g[7] == -7);
+  }
+
+  {
+    // long chains must not exhaust the stack
+    constexpr int chain_length = 200000;
+    DAGGraph<int, int> g;
+    for (int i = 0; i < chain_length; ++i) {
+      g[i] = i;
+      assert(i == 0 || g.AddEdge(i - 1, i));
+    }
+    int expected = 0;
+    g.Walk([&](int key, int) { assert(key == expected++); });
+    assert(expected == chain_length);
+  }
+
   constexpr bool start_from_head = true;
   {
     std::vector<int> v;
@@ -423,6 +432,49 @@ void test() {
     assert(v == stop_order);
   }
 
+  for (bool from_head : {start_from_head, !start_from_head}) {
+    std::vector<std::vector<int>> levels;
+    d.WalkLevels(
+        [&](std::span<const int> keys,
+            std::span<std::unique_ptr<MockPipelineEngine>*> pipelines) {
+          assert(keys.size() == pipelines.size());
+          for (std::unique_ptr<MockPipelineEngine>* pipeline : pipelines) {
+            from_head ? (*pipeline)->Start() : (*pipeline)->Stop();
+          }
+          levels.emplace_back(std::begin(keys), std::end(keys));
+        },
+        from_head);
+    const std::vector<std::vector<int>> start_levels{
+        {13, 6, 8, 11, 0}, {7, 12, 1, 3}, {9, 2, 4}, {10, 5}};
+    const std::vector<std::vector<int>> stop_levels{
+        {13, 7, 10, 5}, {6, 9, 2, 4}, {8, 12, 1, 3}, {11, 0}};
+    assert(levels == (from_head ? start_levels : stop_levels));
+  }
+
+  {
+    // only the cones of 3 and 12 are visited, in topological order
+    assert(d.MarkDirty(3) && d.MarkDirty(12) && d.MarkDirty(9));
+    assert(!d.MarkDirty(nodes_count));
+    std::vector<int> v;
+    d.WalkDirty([&](int key, std::unique_ptr<MockPipelineEngine>& pipeline) {
+      pipeline->Start();
+      v.emplace_back(key);
+    });
+    std::map<int, std::size_t> pos;
+    for (std::size_t i = 0; i < v.size(); ++i) {
+      pos[v[i]] = i;
+    }
+    assert(v.size() == 7 && pos.size() == 7);
+    for (int key : {3, 2, 4, 5, 12, 9, 10}) {
+      assert(pos.count(key));
+    }
+    assert(pos[3] < pos[2] && pos[3] < pos[4] && pos[2] < pos[5] &&
+           pos[4] < pos[5] && pos[12] < pos[9] && pos[9] < pos[10]);
+    d.WalkDirty([](int, std::unique_ptr<MockPipelineEngine>&) {
+      assert(false);  // marks were cleared
+    });
+  }
+
   {
     std::vector<int> v;
     std::vector<int> heads_order{13, 6, 8, 11, 0};
@@ -445,6 +497,237 @@ void test() {
     assert(v == tails_order);
   }
 
+  const std::vector<std::pair<int, int>> edges{
+      {0, 1}, {0, 3}, {1, 2}, {3, 4},  {1, 4},  {3, 2}, {2, 5},
+      {4, 5}, {6, 7}, {8, 9}, {9, 10}, {11, 12}, {12, 9},
+  };
+
+  {
+    jc::ThreadPool pool{4};
+    for (bool from_head : {start_from_head, !start_from_head}) {
+      std::mutex m;
+      std::vector<int> v;
+      d.ParallelWalk(
+          [&](int key, const std::unique_ptr<MockPipelineEngine>& pipeline) {
+            from_head ? pipeline->Start() : pipeline->Stop();
+            std::lock_guard<std::mutex> l(m);
+            v.emplace_back(key);
+          },
+          pool, from_head);
+      assert(v.size() == nodes_count);
+      std::map<int, std::size_t> pos;
+      for (std::size_t i = 0; i < v.size(); ++i) {
+        pos[v[i]] = i;
+      }
+      for (auto [from, to] : edges) {
+        assert(from_head ? pos.at(from) < pos.at(to)
+                         : pos.at(to) < pos.at(from));
+      }
+    }
+  }
+
+  {
+    // tasks run inside Submit() must not find the walk locked
+    InlineExecutor executor;
+    std::vector<int> v;
+    d.ParallelWalk(
+        [&](int key, const std::unique_ptr<MockPipelineEngine>&) {
+          v.emplace_back(key);
+        },
+        executor);
+    assert(v.size() == nodes_count);
+  }
+
+  {
+    // values are sums of the predecessors plus one, pulled from 5 only
+    //  0   1  6
+    //   \ /   |
+    //    2    7
+    //    |
+    //    5
+    DAGGraph<int, int> g;
+    std::map<int, std::vector<int>> inputs{{2, {0, 1}}, {5, {2}}, {7, {6}}};
+    for (int i : {0, 1, 2, 5, 6, 7}) {
+      g[i] = 0;
+    }
+    for (const auto& [to, froms] : inputs) {
+      for (int from : froms) {
+        assert(g.AddEdge(from, to));
+      }
+    }
+    std::mutex m;
+    std::vector<int> evaluated;
+    const auto compute = [&](int key, int& value) {
+      value = 1;
+      if (inputs.count(key)) {
+        for (int from : inputs.at(key)) {
+          value += g[from];  // predecessors are done and not written any more
+        }
+      }
+      std::lock_guard<std::mutex> l(m);
+      evaluated.emplace_back(key);
+    };
+    jc::ThreadPool pool{2};
+    assert(g.Get(5, compute, pool) == 4);
+    std::sort(std::begin(evaluated), std::end(evaluated));
+    assert((evaluated == std::vector<int>{0, 1, 2, 5}));
+    evaluated.clear();
+    assert(g.Get(2, compute, pool) == 3 && evaluated.empty());
+    g.Invalidate(2);
+    assert(g.Get(5, compute, pool) == 4);
+    assert((evaluated == std::vector<int>{2, 5}));
+    // edges into the cone drop the memoized values below them
+    evaluated.clear();
+    inputs[2].emplace_back(6);
+    assert(g.AddEdge(6, 2));
+    assert(g.Get(5, compute, pool) == 5);
+    std::sort(std::begin(evaluated), std::end(evaluated));
+    assert((evaluated == std::vector<int>{2, 5, 6}));
+    evaluated.clear();
+    std::erase(inputs[2], 0);
+    assert(g.RemoveEdge(0, 2));
+    assert(g.Get(5, compute, pool) == 4);
+    assert((evaluated == std::vector<int>{2, 5}));
+  }
+
+  {
+    // 5 hangs until 0 stopped, which only its timeout allows, and a throwing
+    // stop of 3 does not hold back 0 either
+    jc::ThreadPool pool{4};
+    std::promise<void> stopped;
+    std::future<void> stopped_future = stopped.get_future();
+    const auto report = d.ParallelTeardown(
+        [&](int key, const std::unique_ptr<MockPipelineEngine>& pipeline) {
+          pipeline->Stop();
+          if (key == 5) {
+            using namespace std::chrono_literals;
+            assert(stopped_future.wait_for(10s) == std::future_status::ready);
+          } else if (key == 3) {
+            throw std::runtime_error("stop failed");
+          } else if (key == 0) {
+            stopped.set_value();
+          }
+        },
+        pool, std::chrono::milliseconds(20));
+    // other stages may also time out on a loaded machine, so only 5 is
+    // checked for it
+    assert(report.size() == nodes_count);
+    assert(report.front().key == 5 && report.front().timed_out);
+    for (const auto& stage : report) {
+      assert(!stage.error == (stage.key != 3));
+    }
+
+    // no deadline, start + timeout would overflow without saturation
+    DAGGraph<int, int> g;
+    g[0] = 0;
+    g[1] = 1;
+    assert(g.AddEdge(0, 1));
+    const auto unlimited = g.ParallelTeardown(
+        [](int, int) {}, pool, std::chrono::steady_clock::duration::max());
+    assert(unlimited.size() == 2 && unlimited[0].key != unlimited[1].key);
+    for (const auto& stage : unlimited) {
+      assert(!stage.timed_out && !stage.error);
+    }
+  }
+
+  {
+    DAGGraph<int, int, std::allocator<std::byte>, ChromeTracer<int>> g;
+    for (int i = 0; i < nodes_count; ++i) {
+      g[i] = i;
+    }
+    assert(g.AddEdges(edges));
+    const auto count_events = [&] {
+      std::ostringstream os;
+      g.GetTracer().Write(os);
+      const std::string trace = os.str();
+      assert(trace.rfind("{\"traceEvents\":[", 0) == 0);
+      assert(trace.find("{\"name\":\"12\"") != std::string::npos);
+      const std::string complete = "\"ph\":\"X\"";
+      std::size_t events = 0;
+      for (std::size_t pos = trace.find(complete); pos != std::string::npos;
+           pos = trace.find(complete, pos + 1)) {
+        ++events;
+      }
+      return events;
+    };
+    jc::ThreadPool pool{2};
+    g.ParallelWalk([](int, int) {}, pool);
+    assert(count_events() == nodes_count);
+    g.NextKeys();
+    int key = 0;
+    while (g.PopReadyKey(&key)) {
+      g.NextKeys(key);
+    }
+    assert(count_events() == nodes_count);
+
+    DAGGraph<std::string, int, std::allocator<std::byte>,
+             ChromeTracer<std::string>>
+        h;
+    h["tab\t\"quoted\"\n"] = 0;
+    h.ParallelWalk([](const std::string&, int) {}, pool);
+    std::ostringstream os;
+    h.GetTracer().Write(os);
+    assert(os.str().find("\"tab\\u0009\\\"quoted\\\"\\u000a\"") !=
+           std::string::npos);
+  }
+
+  {
+    DAGGraph<int, int> g;
+    for (int i = 0; i < nodes_count; ++i) {
+      g[i] = i * 10;
+    }
+    assert(g.AddEdges(edges));
+    const std::string path =
+        (std::filesystem::temp_directory_path() / "dag_graph.snapshot")
+            .string();
+    assert(g.Save(path));
+    DAGSnapshot<int, int> snapshot;
+    assert(snapshot.Open(path));
+    assert((!DAGSnapshot<int, double>().Open(path)));
+
+    // files whose ids or offsets point past their sections are refused
+    std::string bytes;
+    {
+      std::ifstream is(path, std::ios::binary);
+      bytes.assign(std::istreambuf_iterator<char>(is), {});
+    }
+    DAGSnapshotHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    const auto open_patched = [&](DAGSnapshotHeader::Section section,
+                                  std::size_t i, std::uint64_t v) {
+      std::string patched = bytes;
+      std::memcpy(patched.data() + header.offset[section] + i * sizeof(v), &v,
+                  sizeof(v));
+      std::ofstream(path, std::ios::binary | std::ios::trunc) << patched;
+      return DAGSnapshot<int, int>().Open(path);
+    };
+    assert(!open_patched(DAGSnapshotHeader::kOut, 0, nodes_count));
+    assert(!open_patched(DAGSnapshotHeader::kHeadSequence, 3, -1));
+    assert(!open_patched(DAGSnapshotHeader::kKeyIndex, 0, nodes_count));
+    assert(!open_patched(DAGSnapshotHeader::kInOffsets, nodes_count, 1000));
+    assert(!open_patched(DAGSnapshotHeader::kOutOffsets, 1, 1000));
+    assert(open_patched(DAGSnapshotHeader::kOut, 0, 0));
+    std::filesystem::remove(path);  // the mapping outlives the file
+
+    assert(snapshot.Size() == nodes_count);
+    std::vector<int> v;
+    std::vector<int> start_order{13, 6, 7, 8, 11, 12, 9, 10, 0, 1, 3, 2, 4, 5};
+    snapshot.Walk([&](int key, int value) {
+      assert(value == key * 10);
+      v.emplace_back(key);
+    });
+    assert(v == start_order);
+    v.clear();
+    std::vector<int> stop_order{13, 7, 6, 10, 9, 8, 12, 11, 5, 2, 4, 1, 3, 0};
+    snapshot.Walk([&](int key, int) { v.emplace_back(key); }, !start_from_head);
+    assert(v == stop_order);
+    std::size_t id = 0;
+    assert(snapshot.Find(12, &id) && snapshot.In(id).size() == 1);
+    assert(snapshot.Out(id).size() == 1);
+    assert(snapshot.Key(snapshot.Out(id)[0]) == 9);
+    assert(!snapshot.Find(nodes_count, &id));
+  }
+
   {
     std::vector<int> test_sequence{13, 6, 7, 0,  1,  3, 4,
                                    2,  5, 8, 11, 12, 9, 10};
@@ -463,6 +746,193 @@ void test() {
     }
   }
 
+  {
+    // NextKeys() froze the graph, walks now read the packed layout
+    std::vector<int> v;
+    std::vector<int> start_order{13, 6, 7, 8, 11, 12, 9, 10, 0, 1, 3, 2, 4, 5};
+    d.Walk(
+        [&](int key, const std::unique_ptr<MockPipelineEngine>& pipeline) {
+          assert(pipeline);
+          v.emplace_back(key);
+        },
+        start_from_head);
+    assert(v == start_order);
+    for (int i = 0; i < nodes_count; ++i) {
+      assert(d[i]);
+    }
+  }
+
+  {
+    // many suspended stages share two threads
+    jc::ThreadPool pool{2};
+    std::atomic<int> clock = 0;
+    std::vector<std::atomic<int>> finished_at(nodes_count);
+    d.AsyncWalk(
+        [&](int key,
+            const std::unique_ptr<MockPipelineEngine>& pipeline) -> DAGTask {
+          co_await pool.Schedule();
+          pipeline->Start();
+          co_await pool.Schedule();
+          finished_at[key] = ++clock;
+        },
+        pool);
+    assert(clock == nodes_count);
+    for (auto [from, to] : edges) {
+      assert(finished_at[from] < finished_at[to]);
+    }
+  }
+
+  {
+    // a callback that throws before returning its DAGTask fails the walk
+    // instead of leaving it waiting forever
+    jc::ThreadPool pool{2};
+    bool thrown = false;
+    try {
+      d.AsyncWalk(
+          [&](int key, const std::unique_ptr<MockPipelineEngine>&) -> DAGTask {
+            if (key == 7) {
+              throw std::runtime_error("no task");
+            }
+            return [](jc::ThreadPool& pool) -> DAGTask {
+              co_await pool.Schedule();
+            }(pool);
+          },
+          pool);
+    } catch (const std::runtime_error&) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  {
+    auto schedule = d.MakeConcurrentSchedule();
+    std::atomic<int> clock = 0;
+    std::vector<std::atomic<int>> finished_at(nodes_count);
+    std::function<void(int)> complete;
+    jc::ThreadPool pool{4};
+    complete = [&](int key) {
+      finished_at[key] = ++clock;
+      for (int next : schedule.Complete(key)) {
+        pool.Submit([&, next] { complete(next); });
+      }
+    };
+    for (int key : schedule.Heads()) {
+      pool.Submit([&, key] { complete(key); });
+    }
+    while (!schedule.Done()) {
+      std::this_thread::yield();
+    }
+    assert(clock == nodes_count);
+    for (auto [from, to] : edges) {
+      assert(finished_at[from] < finished_at[to]);
+    }
+  }
+
+  {
+    // two workers, 0 -> 1 is the critical path
+    using SchedulePolicy = DAGGraph<int, int>::SchedulePolicy;
+    const auto makespan = [](SchedulePolicy policy) {
+      const std::vector<double> costs{1, 10, 3, 3, 3};
+      DAGGraph<int, int> g;
+      for (int i : {2, 3, 4, 0, 1}) {
+        g[i] = i;
+        g.SetCost(i, costs[i]);
+      }
+      assert(g.AddEdge(0, 1));
+      g.NextKeys(policy);
+      constexpr std::size_t workers = 2;
+      std::multimap<double, int> running;
+      double now = 0;
+      int key = 0;
+      while (true) {
+        while (running.size() < workers && g.PopReadyKey(&key)) {
+          running.emplace(now + costs[key], key);
+        }
+        if (running.empty()) {
+          break;
+        }
+        now = running.begin()->first;
+        g.NextKeys(running.begin()->second);
+        running.erase(running.begin());
+      }
+      return now;
+    };
+    assert(makespan(SchedulePolicy::kFifo) == 14);
+    assert(makespan(SchedulePolicy::kCriticalPath) == 11);
+  }
+
+  {
+    // 0..3 are memory hungry and may only run one at a time on 3 workers,
+    // 4..7 fill the remaining workers meanwhile
+    DAGGraph<int, int> g;
+    for (int i = 0; i < 8; ++i) {
+      g[i] = i;
+      g.SetResourceClass(i, i < 4 ? 1 : 0);
+    }
+    assert(g.AddEdge(0, 1) && g.AddEdge(4, 5));
+    g.SetClassLimit(1, 1);
+    g.NextKeys();
+    std::vector<int> running;
+    std::vector<int> finished;
+    int key = 0;
+    while (true) {
+      while (running.size() < 3 && g.PopReadyKey(&key)) {
+        running.emplace_back(key);
+      }
+      assert(std::count_if(std::begin(running), std::end(running),
+                           [](int k) { return k < 4; }) <= 1);
+      if (running.empty()) {
+        break;
+      }
+      if (finished.empty()) {
+        // 3 is ready before 6 and 7 but waits for 2
+        assert((running == std::vector<int>{2, 6, 7}));
+      }
+      finished.emplace_back(running.front());
+      g.NextKeys(running.front());
+      running.erase(std::begin(running));
+    }
+    assert((finished == std::vector<int>{2, 6, 7, 3, 4, 0, 5, 1}));
+  }
+
+  for (GraphShape shape :
+       {GraphShape::kLayered, GraphShape::kWideFanOut, GraphShape::kDeepChain,
+        GraphShape::kSmallComponents}) {
+    // generated graphs well beyond the hand made one, walks and a full
+    // schedule must visit every node after all its predecessors
+    constexpr int n = 5000;
+    const std::vector<std::pair<int, int>> edges = MakeEdges(shape, n, 42);
+    DAGGraph<int, int> g;
+    for (int i = 0; i < n; ++i) {
+      g[i] = i;
+    }
+    for (auto [from, to] : edges) {
+      assert(g.AddEdge(from, to));  // a repeated edge is kept only once
+    }
+    auto check_order = [&](const std::vector<int>& order) {
+      assert(order.size() == n);
+      std::vector<int> position(n, -1);
+      for (std::size_t i = 0; i < order.size(); ++i) {
+        assert(position[order[i]] == -1);
+        position[order[i]] = static_cast<int>(i);
+      }
+      for (auto [from, to] : edges) {
+        assert(position[from] < position[to]);
+      }
+    };
+    std::vector<int> order;
+    g.Walk([&](int key, int) { order.emplace_back(key); });
+    check_order(order);
+    order.clear();
+    g.NextKeys();
+    int key = 0;
+    while (g.PopReadyKey(&key)) {
+      order.emplace_back(key);
+      g.NextKeys(key);
+    }
+    check_order(order);
+  }
+
   d.Clear();
   assert(d.Size() == 0);
   for (int i = 0; i < nodes_count; ++i) {
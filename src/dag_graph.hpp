@@ -0,0 +1,2797 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <queue>
+#include <ranges>
+#include <set>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thread_pool.hpp"
+
+namespace jc {
+
+// Rebind an allocator of std::byte to the element type of a container
+template <typename Alloc, typename T>
+using Rebind = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+template <typename K, typename V, typename Alloc = std::allocator<std::byte>>
+struct DAGNode {
+  struct IdLess {
+    bool operator()(const DAGNode* lhs, const DAGNode* rhs) const {
+      return lhs->id < rhs->id;
+    }
+  };
+
+  // k and v take alloc too when they are allocator aware
+  explicit DAGNode(const Alloc& alloc = Alloc())
+      : k(std::make_obj_using_allocator<K>(alloc)),
+        v(std::make_obj_using_allocator<V>(alloc)),
+        in(alloc),
+        out(alloc) {}
+
+  K k;
+  V v;
+  std::set<DAGNode*, IdLess, Rebind<Alloc, DAGNode*>> in;
+  std::set<DAGNode*, IdLess, Rebind<Alloc, DAGNode*>> out;
+  std::size_t id = 0;    // slot index, reused after the node is removed
+  std::size_t ord = 0;   // position in topological order kept by AddEdge()
+  std::size_t mark = 0;  // visit generation of the last traversal
+  double cost = 1;       // estimated run time used by kCriticalPath
+  std::size_t resource_class = 0;  // admission limit used by PopReadyKey()
+  bool alive = true;     // false while the slot waits for reuse
+};
+
+// Coroutine returned by AsyncWalk() callbacks, starts suspended
+class DAGTask {
+ public:
+  struct promise_type {
+    DAGTask get_return_object() {
+      return DAGTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    auto final_suspend() noexcept {
+      struct Awaiter {
+        bool await_ready() noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          std::function<void(std::exception_ptr)> done =
+              std::move(h.promise().done);
+          std::exception_ptr error = h.promise().error;
+          h.destroy();
+          done(error);
+        }
+
+        void await_resume() noexcept {}
+      };
+      return Awaiter{};
+    }
+
+    void return_void() {}
+
+    void unhandled_exception() { error = std::current_exception(); }
+
+    std::function<void(std::exception_ptr)> done;
+    std::exception_ptr error;
+  };
+
+  DAGTask(DAGTask&& rhs) noexcept : h_(std::exchange(rhs.h_, {})) {}
+
+  DAGTask& operator=(DAGTask&& rhs) noexcept {
+    std::swap(h_, rhs.h_);
+    return *this;
+  }
+
+  ~DAGTask() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  // Run until the first suspension, done is called once the body finishes
+  void Start(std::function<void(std::exception_ptr)> done) && {
+    std::coroutine_handle<promise_type> h = std::exchange(h_, {});
+    h.promise().done = std::move(done);
+    h.resume();
+  }
+
+ private:
+  explicit DAGTask(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+// Record a key or value is stored as in a snapshot, specialize it to map a
+// type that is not trivially copyable onto one that is
+template <typename T>
+struct SnapshotCodec {
+  static_assert(std::is_trivially_copyable_v<T>, "specialize SnapshotCodec");
+
+  using Encoded = T;
+
+  static Encoded Encode(const T& v) { return v; }
+
+  static T Decode(const Encoded& e) { return e; }
+};
+
+// Snapshot file: this header, then each section aligned to kAlignment,
+// offsets are relative to the start of the file
+struct DAGSnapshotHeader {
+  enum Section {
+    kKeys,              // Encoded K per slot
+    kValues,            // Encoded V per slot
+    kInOffsets,         // slots + 1 entries
+    kIn,
+    kOutOffsets,        // slots + 1 entries
+    kOut,
+    kHeadSequence,      // Walk() order
+    kTailSequence,      // Walk(f, false) order
+    kKeyIndex,          // live slots sorted by key
+    kSectionCount,
+  };
+
+  static constexpr char kMagic[8] = "jcdag02";
+  static constexpr std::size_t kAlignment = 64;
+
+  char magic[8];
+  std::uint64_t key_size;
+  std::uint64_t value_size;
+  std::uint64_t offset[kSectionCount];
+  std::uint64_t count[kSectionCount];
+};
+
+// Tracer hooks get the slot id and key of a node: Reset() before a run,
+// Ready() once its dependencies are done, Start() and Finish() around its
+// stage, possibly from worker threads but never twice at once for one id
+struct NullTracer {
+  void Reset(std::size_t) {}
+
+  template <typename K>
+  void Ready(std::size_t, const K&) {}
+
+  template <typename K>
+  void Start(std::size_t, const K&) {}
+
+  template <typename K>
+  void Finish(std::size_t, const K&) {}
+};
+
+// Record the last run in one slot per node and export it as Chrome
+// trace-event JSON, for chrome://tracing or Perfetto
+template <typename K>
+class ChromeTracer {
+ public:
+  void Reset(std::size_t slots);
+
+  void Ready(std::size_t id, const K& key);
+
+  void Start(std::size_t id, const K& key);
+
+  void Finish(std::size_t id, const K& key);
+
+  // One complete event per finished node on the thread that ran it, with the
+  // time from ready to start as queue_wait_us, named by the key as written
+  // by operator<< and escaped as a JSON string
+  void Write(std::ostream& os) const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Event {
+    K key{};
+    Clock::time_point ready;
+    Clock::time_point start;  // left unset by NextKeys() without PopReadyKey()
+    Clock::time_point finish;
+    std::thread::id thread;
+    bool finished = false;
+  };
+
+ private:
+  Clock::time_point origin_;
+  std::vector<Event> events_;
+};
+
+template <typename K>
+inline void ChromeTracer<K>::Reset(std::size_t slots) {
+  origin_ = Clock::now();
+  events_.assign(slots, Event{});
+}
+
+template <typename K>
+inline void ChromeTracer<K>::Ready(std::size_t id, const K& key) {
+  events_[id].key = key;
+  events_[id].ready = Clock::now();
+}
+
+template <typename K>
+inline void ChromeTracer<K>::Start(std::size_t id, const K&) {
+  events_[id].start = Clock::now();
+  events_[id].thread = std::this_thread::get_id();
+}
+
+template <typename K>
+inline void ChromeTracer<K>::Finish(std::size_t id, const K&) {
+  events_[id].finish = Clock::now();
+  events_[id].finished = true;
+}
+
+template <typename K>
+inline void ChromeTracer<K>::Write(std::ostream& os) const {
+  const auto micros = [&](Clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(t - origin_).count();
+  };
+  std::map<std::thread::id, std::size_t> tids;
+  os << "{\"traceEvents\":[";
+  const char* separator = "\n";
+  for (const Event& e : events_) {
+    if (!e.finished) {
+      continue;
+    }
+    std::ostringstream name;
+    name << e.key;
+    std::string escaped;
+    for (char c : name.str()) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+        escaped += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        escaped += "\\u00";
+        escaped += "0123456789abcdef"[c >> 4];
+        escaped += "0123456789abcdef"[c & 0xf];
+      } else {
+        escaped += c;
+      }
+    }
+    const Clock::time_point start =
+        e.start == Clock::time_point() ? e.ready : e.start;
+    const std::size_t tid = tids.emplace(e.thread, tids.size()).first->second;
+    os << separator << "{\"name\":\"" << escaped
+       << "\",\"cat\":\"dag\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+       << ",\"ts\":" << micros(start)
+       << ",\"dur\":" << micros(e.finish) - micros(start)
+       << ",\"args\":{\"queue_wait_us\":" << micros(start) - micros(e.ready)
+       << "}}";
+    separator = ",\n";
+  }
+  os << "\n]}\n";
+}
+
+// std::hash that also takes anything convertible to std::string_view, so
+// string keys are found by std::string_view or const char* without a copy
+template <typename K>
+struct TransparentHash {
+  using is_transparent = void;
+
+  template <typename KeyLike>
+  std::size_t operator()(const KeyLike& key) const {
+    if constexpr (std::is_convertible_v<const KeyLike&, std::string_view>) {
+      return std::hash<std::string_view>{}(key);
+    } else {
+      return std::hash<K>{}(key);
+    }
+  }
+};
+
+// Open addressing with linear probing and backward shift erase, entries
+// live inline in one power of two array kept at most 7/8 full
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+class FlatHashMap {
+ public:
+  using value_type = std::pair<K, T>;
+
+  template <bool kConst>
+  class Iterator {
+   public:
+    using Slot = std::conditional_t<kConst, const std::optional<value_type>,
+                                    std::optional<value_type>>;
+    using Reference =
+        std::conditional_t<kConst, const value_type&, value_type&>;
+
+    Iterator(Slot* slot, Slot* last) : slot_(slot), last_(last) { Skip(); }
+
+    Reference operator*() const { return **slot_; }
+
+    auto operator->() const { return &**slot_; }
+
+    Iterator& operator++() {
+      ++slot_;
+      Skip();
+      return *this;
+    }
+
+    bool operator==(const Iterator& rhs) const { return slot_ == rhs.slot_; }
+
+   private:
+    void Skip() {
+      while (slot_ != last_ && !*slot_) {
+        ++slot_;
+      }
+    }
+
+   private:
+    Slot* slot_;
+    Slot* last_;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  explicit FlatHashMap(const Alloc& alloc = Alloc()) : slots_(alloc) {}
+
+  iterator begin() { return {slots_.data(), slots_.data() + slots_.size()}; }
+
+  iterator end() { return At(slots_.size()); }
+
+  const_iterator begin() const {
+    return {slots_.data(), slots_.data() + slots_.size()};
+  }
+
+  const_iterator end() const { return At(slots_.size()); }
+
+  template <typename KeyLike>
+  iterator find(const KeyLike& key) {
+    return At(Find(key));
+  }
+
+  template <typename KeyLike>
+  const_iterator find(const KeyLike& key) const {
+    return At(Find(key));
+  }
+
+  template <typename KeyArg>
+  std::pair<iterator, bool> emplace(KeyArg&& key, const T& value);
+
+  std::size_t erase(const K& key);
+
+  std::size_t size() const { return size_; }
+
+  void clear();
+
+ private:
+  using Slot = std::optional<value_type>;
+
+  template <typename KeyLike>
+  std::size_t Home(const KeyLike& key) const;
+
+  // Slot of key, slots_.size() if missing
+  template <typename KeyLike>
+  std::size_t Find(const KeyLike& key) const;
+
+  iterator At(std::size_t i) {
+    return {slots_.data() + i, slots_.data() + slots_.size()};
+  }
+
+  const_iterator At(std::size_t i) const {
+    return {slots_.data() + i, slots_.data() + slots_.size()};
+  }
+
+  void Rehash(std::size_t capacity);
+
+ private:
+  std::vector<Slot, Rebind<Alloc, Slot>> slots_;
+  std::size_t size_ = 0;
+  int shift_ = 64;  // 64 - log2(capacity), Home() keeps the top bits
+};
+
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+template <typename KeyArg>
+inline auto FlatHashMap<K, T, Hash, KeyEqual, Alloc>::emplace(KeyArg&& key,
+                                                              const T& value)
+    -> std::pair<iterator, bool> {
+  if ((size_ + 1) * 8 > slots_.size() * 7) {
+    Rehash(std::max<std::size_t>(16, slots_.size() * 2));
+  }
+  const std::size_t mask = slots_.size() - 1;
+  std::size_t i = Home(key);
+  for (; slots_[i]; i = (i + 1) & mask) {
+    if (KeyEqual{}(slots_[i]->first, key)) {
+      return {At(i), false};
+    }
+  }
+  slots_[i].emplace(std::make_obj_using_allocator<value_type>(
+      slots_.get_allocator(), std::forward<KeyArg>(key), value));
+  ++size_;
+  return {At(i), true};
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+inline std::size_t FlatHashMap<K, T, Hash, KeyEqual, Alloc>::erase(
+    const K& key) {
+  std::size_t i = Find(key);
+  if (i == slots_.size()) {
+    return 0;
+  }
+  // pull back later entries of the run that may not stay behind the hole
+  const std::size_t mask = slots_.size() - 1;
+  slots_[i].reset();
+  for (std::size_t j = (i + 1) & mask; slots_[j]; j = (j + 1) & mask) {
+    const std::size_t home = Home(slots_[j]->first);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      slots_[i] = std::move(slots_[j]);
+      slots_[j].reset();
+      i = j;
+    }
+  }
+  --size_;
+  return 1;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+inline void FlatHashMap<K, T, Hash, KeyEqual, Alloc>::clear() {
+  for (Slot& slot : slots_) {
+    slot.reset();
+  }
+  size_ = 0;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+template <typename KeyLike>
+inline std::size_t FlatHashMap<K, T, Hash, KeyEqual, Alloc>::Home(
+    const KeyLike& key) const {
+  // Fibonacci hashing spreads identity hashes of small integers
+  const std::uint64_t h = Hash{}(key);
+  return shift_ == 64 ? 0 : (h * 0x9E3779B97F4A7C15ull) >> shift_;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+template <typename KeyLike>
+inline std::size_t FlatHashMap<K, T, Hash, KeyEqual, Alloc>::Find(
+    const KeyLike& key) const {
+  if (size_ == 0) {
+    return slots_.size();
+  }
+  const std::size_t mask = slots_.size() - 1;
+  for (std::size_t i = Home(key); slots_[i]; i = (i + 1) & mask) {
+    if (KeyEqual{}(slots_[i]->first, key)) {
+      return i;
+    }
+  }
+  return slots_.size();
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual,
+          typename Alloc>
+inline void FlatHashMap<K, T, Hash, KeyEqual, Alloc>::Rehash(
+    std::size_t capacity) {
+  std::vector<Slot, Rebind<Alloc, Slot>> slots(capacity,
+                                               slots_.get_allocator());
+  std::swap(slots, slots_);
+  shift_ = 64 - std::countr_zero(capacity);
+  size_ = 0;
+  for (Slot& slot : slots) {
+    if (slot) {
+      emplace(std::move(slot->first), std::move(slot->second));
+    }
+  }
+}
+
+// Key index policies, Map<K, Alloc> holds the DAGNode::id of each key and
+// finds keys by any type comparable with K
+struct OrderedIndex {
+  template <typename K, typename Alloc>
+  using Map = std::map<K, std::size_t, std::less<>,
+                       Rebind<Alloc, std::pair<const K, std::size_t>>>;
+};
+
+struct FlatHashIndex {
+  template <typename K, typename Alloc>
+  using Map = FlatHashMap<K, std::size_t, TransparentHash<K>,
+                          std::equal_to<>, Alloc>;
+};
+
+// Every container of the graph allocates through Alloc, see jc::pmr below,
+// scratch buffers included. Results returned by value and the tasks of
+// executor calls, which may be freed on other threads, use the global heap.
+// Tracer observes walks and schedules, see NullTracer, Index maps keys to
+// slots, see OrderedIndex
+template <typename K, typename V, typename Alloc = std::allocator<std::byte>,
+          typename Tracer = NullTracer, typename Index = OrderedIndex>
+class DAGGraph {
+ public:
+  using allocator_type = Alloc;
+
+  explicit DAGGraph(const Alloc& alloc = Alloc()) : alloc_(alloc) {}
+
+  allocator_type get_allocator() const;
+
+  Tracer& GetTracer();
+
+  // Keys are looked up once per call and may be of any type the Index
+  // compares with K, such as std::string_view for std::string keys
+  template <typename FromKey, typename ToKey>
+  bool AddEdge(const FromKey& from, const ToKey& to);
+
+  template <typename KeyLike>
+  V& operator[](const KeyLike& key);
+
+  // Insert missing keys with default values
+  template <typename Range>
+  void AddNodes(const Range& keys);
+
+  // Add all (from, to) pairs or none of them if any endpoint is missing or
+  // the batch would close a cycle, checked with one topological sort
+  template <typename Range>
+  bool AddEdges(const Range& edges);
+
+  // Remove the node and its edges, its slot is reused by a later insert
+  template <typename KeyLike>
+  bool RemoveNode(const KeyLike& key);
+
+  template <typename FromKey, typename ToKey>
+  bool RemoveEdge(const FromKey& from, const ToKey& to);
+
+  // Move the connected component containing key into a new graph, which
+  // allocates through the same Alloc, so with jc::pmr it shares the memory
+  // resource of this graph and must not outlive it
+  template <typename KeyLike>
+  DAGGraph ExtractComponent(const KeyLike& key);
+
+  // Drop every edge implied by a longer path, reachability is unchanged,
+  // needs a bitset of n / 64 words per node of the largest component
+  void TransitiveReduction();
+
+  // Keep the transitive closure as one bitset per node so Reachable() and
+  // the cycle check of AddEdge() are O(1), costs n^2 / 8 bytes and is
+  // rebuilt on the next query after removals or AddEdges(). An edge not
+  // already implied still runs the Pearce-Kelly reordering, then scans all
+  // n slots and ORs n / 64 words into the row of every node reaching from,
+  // up to n^2 / 64 word operations per edge, so keep it to some 10^4 nodes
+  void EnableReachabilityIndex(bool enable = true);
+
+  // Whether a path leads from one key to the other, a key reaches itself
+  template <typename FromKey, typename ToKey>
+  bool Reachable(const FromKey& from, const ToKey& to);
+
+  template <typename KeyLike>
+  bool Exist(const KeyLike& key) const;
+
+  template <typename KeyLike>
+  void SetCost(const KeyLike& key, double cost);
+
+  // Nodes are in class 0 until set, classes without a limit are unbounded
+  template <typename KeyLike>
+  void SetResourceClass(const KeyLike& key, std::size_t resource_class);
+
+  // At most limit nodes of the class are handed out by PopReadyKey() and not
+  // yet finished, set before NextKeys()
+  void SetClassLimit(std::size_t resource_class, std::size_t limit);
+
+  void Clear();
+
+  std::size_t Size() const;
+
+  void Walk(std::function<void(const K& k, const V& v)> f,
+            bool start_from_head = true);
+
+  void WalkHeads(std::function<void(const K& k, const V& v)> f);
+
+  void WalkTails(std::function<void(const K& k, const V& v)> f);
+
+  // Overloads taking the callable directly, no type erasure per node
+  template <typename F>
+  void Walk(F&& f, bool start_from_head = true);
+
+  template <typename F>
+  void WalkHeads(F&& f);
+
+  template <typename F>
+  void WalkTails(F&& f);
+
+  // Like Walk() but f receives V& to update values in place
+  template <typename F>
+  void WalkMutable(F&& f, bool start_from_head = true);
+
+  // Call f(std::span<const K>, std::span<V*>) once per level, a level holds
+  // the nodes whose longest path from a head (to a tail if !start_from_head)
+  // has the same length, so no node depends on another one of its level
+  template <typename F>
+  void WalkLevels(F&& f, bool start_from_head = true);
+
+  // Queue key and its descendants for the next WalkDirty(), false if missing
+  template <typename KeyLike>
+  bool MarkDirty(const KeyLike& key);
+
+  // Like WalkMutable() from heads but only over the dirty nodes and their
+  // descendants, costs the size of that cone, then clears the marks
+  template <typename F>
+  void WalkDirty(F&& f);
+
+  // Call f for each node on executor as soon as all its predecessors
+  // (successors if !start_from_head) have returned, block until all done
+  template <typename Executor>
+  void ParallelWalk(std::function<void(const K& k, const V& v)> f,
+                    Executor& executor, bool start_from_head = true);
+
+  // Same order as ParallelWalk(), f returns a DAGTask and a node counts as
+  // finished when its coroutine completes, so suspended stages hold no thread
+  template <typename F, typename Executor>
+  void AsyncWalk(F f, Executor& executor, bool start_from_head = true);
+
+  struct TeardownStage {
+    K key;
+    std::chrono::steady_clock::duration duration;  // time spent in f
+    bool timed_out = false;  // predecessors went on without it
+    std::exception_ptr error;
+  };
+
+  // Stop order ParallelWalk() for shutdown: f runs for a node once all its
+  // successors have returned, thrown or run past timeout. The timeout only
+  // releases the predecessors, a stage past it keeps its executor thread
+  // and is waited for before returning, so a hung stage still blocks the
+  // call. Returns every stage, longest first
+  template <typename Executor>
+  std::vector<TeardownStage> ParallelTeardown(
+      std::function<void(const K& k, const V& v)> f, Executor& executor,
+      std::chrono::steady_clock::duration timeout);
+
+  // Pull mode: f(k, V&) computes the value of each node of the predecessor
+  // cone of key not evaluated yet, on executor once the predecessors of
+  // the node are done, so independent ones run in parallel. Values stay
+  // memoized until Invalidate(), or until an edge into the node or one of
+  // its ancestors is added or removed
+  template <typename KeyLike, typename F, typename Executor>
+  V& Get(const KeyLike& key, F f, Executor& executor);
+
+  // Evaluate key and its descendants again on the next Get()
+  template <typename KeyLike>
+  void Invalidate(const KeyLike& key);
+
+  // Pack the graph, no more modification allowed unless Clear()
+  void Freeze();
+
+  // Freeze and write a snapshot that DAGSnapshot maps back without parsing
+  bool Save(const std::string& path);
+
+  enum class SchedulePolicy {
+    kFifo,          // in the order keys became ready
+    kCriticalPath,  // longest cost path to a tail first
+  };
+
+  // Freeze the graph and return heads
+  std::unordered_set<K> NextKeys(
+      SchedulePolicy policy = SchedulePolicy::kFifo);
+
+  std::unordered_set<K> NextKeys(const K& key);
+
+  // Ready keys are also queued, hand out the next one by policy whose class
+  // is below its limit, false if none is ready or all ready ones wait for
+  // their class
+  bool PopReadyKey(K* key);
+
+  // Lock-free counterpart of NextKeys() for completions from many threads
+  class ConcurrentSchedule {
+   public:
+    explicit ConcurrentSchedule(const DAGGraph& graph);
+
+    std::vector<K> Heads() const;
+
+    // Returns the successors of key that became ready
+    std::vector<K> Complete(const K& key);
+
+    bool Done() const;
+
+   private:
+    const DAGGraph& graph_;
+    std::unique_ptr<std::atomic<std::size_t>[]> in_degree_;
+    std::atomic<std::size_t> unfinished_;
+  };
+
+  // Freeze the graph and start a schedule, the graph must outlive it
+  ConcurrentSchedule MakeConcurrentSchedule();
+
+ private:
+  template <typename T>
+  using Vector = std::vector<T, Rebind<Alloc, T>>;
+
+  // Compressed sparse row layout built by Freeze(), indexed by DAGNode::id
+  struct FrozenGraph {
+    explicit FrozenGraph(const Alloc& alloc)
+        : keys(alloc),
+          values(alloc),
+          in_offsets(alloc),
+          in(alloc),
+          out_offsets(alloc),
+          out(alloc) {}
+
+    Vector<K> keys;
+    Vector<V> values;
+    Vector<std::size_t> in_offsets;
+    Vector<std::size_t> in;
+    Vector<std::size_t> out_offsets;
+    Vector<std::size_t> out;
+  };
+
+  // Pearce-Kelly: only nodes whose ord lies in [to.ord, from.ord] are visited
+  bool UpdateTopologicalOrder(DAGNode<K, V, Alloc>* from,
+                              DAGNode<K, V, Alloc>* to);
+
+  // Assign key to the slot so K keeps the graph allocator
+  template <typename KeyLike>
+  DAGNode<K, V, Alloc>& InsertNode(const KeyLike& key);
+
+  void LinkNodes(DAGNode<K, V, Alloc>* from, DAGNode<K, V, Alloc>* to);
+
+  // Tombstone a node whose edges are already unlinked
+  void ReleaseNode(std::size_t id);
+
+  // Drop the memoized Get() values of id and its descendants
+  void InvalidateFrom(std::size_t id);
+
+  // DAGNode::id of key or nullptr, the one index lookup per key of a call
+  template <typename KeyLike>
+  const std::size_t* FindId(const KeyLike& key) const;
+
+  bool ReachBit(std::size_t from, std::size_t to) const;
+
+  // Add everything reachable from to to every node reaching from
+  void ExtendReach(std::size_t from, std::size_t to);
+
+  // Rows leave room for new slots until the node count passes a multiple
+  // of 64
+  void RebuildReachabilityIndex();
+
+  // Recompute sequences only for the components touched since last time
+  void RefreshWalkSequences();
+
+  // Cached sequence of each component in walk order
+  Vector<std::span<const std::size_t>> ConnectedComponents(
+      bool start_from_head);
+
+  template <typename F>
+  void ForEachInSequences(bool start_from_head, F&& f);
+
+  const K& KeyOf(std::size_t id) const;
+
+  const V& ValueOf(std::size_t id) const;
+
+  V& ValueOf(std::size_t id);
+
+  std::size_t Degree(std::size_t id, bool in) const;
+
+  template <typename F>
+  void ForEachAdjacent(std::size_t id, bool in, F&& f) const;
+
+  // Submit run(id, done) for each node once its predecessors (successors if
+  // !start_from_head) are done and block until all done, run must call
+  // done(error) exactly once, possibly from another thread. Only ids and the
+  // edges among them are scheduled unless ids is empty
+  template <typename Executor, typename Run>
+  void Dispatch(Executor& executor, bool start_from_head, Run run,
+                std::span<const std::size_t> ids = {});
+
+  // Union-find over ids, maintained by operator[] and AddEdge()
+  std::size_t FindComponent(std::size_t id);
+
+  void UnionComponents(std::size_t lhs, std::size_t rhs);
+
+  void ComponentMembers(std::size_t id, Vector<std::size_t>* members);
+
+  // Split ids into fresh sets after edges among them were removed
+  void RebuildComponents(Vector<std::size_t> ids);
+
+  Vector<std::size_t> TopologicalSequence(
+      const Vector<std::size_t>& connected_component,
+      bool start_from_head);
+
+ private:
+  static constexpr std::size_t kNoComponent = static_cast<std::size_t>(-1);
+  static constexpr std::size_t kNoLimit = static_cast<std::size_t>(-1);
+
+ private:
+  using ReadyEntry = std::tuple<double, std::ptrdiff_t, std::size_t>;
+
+ private:
+  Alloc alloc_;  // declared first, the members below are built from it
+  [[no_unique_address]] Tracer tracer_;
+  typename Index::template Map<K, Alloc> bucket_{alloc_};  // key to id
+  std::unordered_set<K, std::hash<K>, std::equal_to<K>, Rebind<Alloc, K>>
+      heads_{alloc_};
+  std::unordered_set<K, std::hash<K>, std::equal_to<K>, Rebind<Alloc, K>>
+      tails_{alloc_};
+  // slots indexed by DAGNode::id
+  std::deque<DAGNode<K, V, Alloc>, Rebind<Alloc, DAGNode<K, V, Alloc>>> nodes_{
+      alloc_};
+  Vector<std::size_t> free_ids_{alloc_};  // removed slots for reuse
+  // Sequences are cached per component slot and walked in component_order_
+  Vector<Vector<std::size_t>> sequences_start_from_head_{alloc_};
+  Vector<Vector<std::size_t>> sequences_start_from_tail_{alloc_};
+  Vector<std::size_t> component_first_{alloc_};  // smallest id of each slot
+  Vector<std::size_t> component_order_{alloc_};
+  Vector<std::size_t> free_components_{alloc_};
+  Vector<std::size_t> component_of_{alloc_};  // slot of each id
+  Vector<std::size_t> component_parent_{alloc_};
+  Vector<std::size_t> component_size_{alloc_};
+  Vector<std::size_t> component_next_{alloc_};  // circular list of members
+  Vector<std::size_t> dirty_{alloc_};  // ids touched since last refresh
+  Vector<std::size_t> members_{alloc_};
+  Vector<std::size_t> degree_{alloc_};
+  std::size_t next_ord_ = 0;
+  std::size_t visit_mark_ = 0;
+  Vector<DAGNode<K, V, Alloc>*> forward_{alloc_};
+  Vector<DAGNode<K, V, Alloc>*> backward_{alloc_};
+  Vector<DAGNode<K, V, Alloc>*> stack_{alloc_};
+  Vector<std::size_t> ords_{alloc_};
+  Vector<std::uint64_t> reach_{alloc_};  // row of reach_words_ per id
+  std::size_t reach_words_ = 0;
+  bool reach_enabled_ = false;
+  bool reach_stale_ = true;  // rebuilt by the next Reachable()
+  Vector<std::uint64_t> marked_{alloc_};  // bit per id set by MarkDirty()
+  Vector<std::size_t> marked_ids_{alloc_};
+  // set by Get(), a node is only evaluated after all its predecessors
+  Vector<bool> evaluated_{alloc_};
+
+ private:
+  bool allow_modify_ = true;
+  FrozenGraph frozen_{alloc_};
+  Vector<std::size_t> in_degree_for_next_{alloc_};  // unfinished predecessors
+  Vector<bool> ready_for_next_{alloc_};  // handed out, not finished
+  Vector<double> priority_for_next_{alloc_};
+  std::size_t ready_count_for_next_ = 0;
+  // (priority, -arrival) max-heap of ready ids
+  std::priority_queue<ReadyEntry, Vector<ReadyEntry>> ready_queue_for_next_{
+      alloc_};
+  Vector<bool> started_for_next_{alloc_};  // handed out by PopReadyKey()
+  Vector<std::size_t> class_limit_{alloc_};
+  Vector<std::size_t> class_running_{alloc_};
+  // max-heaps of ready entries popped while their class was full
+  Vector<Vector<ReadyEntry>> class_waiting_{alloc_};
+};
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename FromKey, typename ToKey>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::AddEdge(const FromKey& from,
+                                                          const ToKey& to) {
+  assert(allow_modify_);
+  const std::size_t* from_id = FindId(from);
+  const std::size_t* to_id = FindId(to);
+  if (!from_id || !to_id || *from_id == *to_id) {
+    return false;
+  }
+  DAGNode<K, V, Alloc>* from_node = &nodes_[*from_id];
+  DAGNode<K, V, Alloc>* to_node = &nodes_[*to_id];
+  const bool indexed = reach_enabled_ && !reach_stale_;
+  if (indexed && ReachBit(to_node->id, from_node->id)) {
+    return false;
+  }
+  // an implied edge keeps both the order and the closure
+  if (indexed && ReachBit(from_node->id, to_node->id)) {
+    LinkNodes(from_node, to_node);
+    return true;
+  }
+  if (!UpdateTopologicalOrder(from_node, to_node)) {
+    return false;
+  }
+  LinkNodes(from_node, to_node);
+  if (indexed) {
+    ExtendReach(from_node->id, to_node->id);
+  }
+  return true;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline V& DAGGraph<K, V, Alloc, Tracer, Index>::operator[](const KeyLike& key) {
+  if (const std::size_t* id = FindId(key)) {
+    return ValueOf(*id);
+  }
+  assert(allow_modify_);
+  return InsertNode(key).v;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename Range>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::AddNodes(const Range& keys) {
+  assert(allow_modify_);
+  if constexpr (std::ranges::sized_range<Range>) {
+    const std::size_t n = nodes_.size() + std::ranges::size(keys);
+    component_of_.reserve(n);
+    component_parent_.reserve(n);
+    component_size_.reserve(n);
+    component_next_.reserve(n);
+    heads_.reserve(n);
+    tails_.reserve(n);
+  }
+  for (const auto& key : keys) {
+    if (!FindId(key)) {
+      InsertNode(key);
+    }
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename Range>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::AddEdges(const Range& edges) {
+  assert(allow_modify_);
+  Vector<std::pair<DAGNode<K, V, Alloc>*, DAGNode<K, V, Alloc>*>> links(
+      alloc_);
+  if constexpr (std::ranges::sized_range<Range>) {
+    links.reserve(std::ranges::size(edges));
+  }
+  for (const auto& [from, to] : edges) {
+    const std::size_t* from_id = FindId(from);
+    const std::size_t* to_id = FindId(to);
+    if (!from_id || !to_id || *from_id == *to_id) {
+      return false;
+    }
+    links.emplace_back(&nodes_[*from_id], &nodes_[*to_id]);
+  }
+
+  // Kahn's algorithm over existing edges plus the batch in CSR form
+  const std::size_t n = nodes_.size();
+  Vector<std::size_t> offsets(n + 1, 0, alloc_);
+  for (auto [from, to] : links) {
+    ++offsets[from->id + 1];
+  }
+  std::partial_sum(std::begin(offsets), std::end(offsets), std::begin(offsets));
+  Vector<std::size_t> targets(links.size(), alloc_);
+  Vector<std::size_t> cursor(std::begin(offsets), std::end(offsets) - 1,
+                             alloc_);
+  degree_.assign(n, 0);
+  for (auto [from, to] : links) {
+    targets[cursor[from->id]++] = to->id;
+    ++degree_[to->id];
+  }
+  Vector<std::size_t> order(alloc_);
+  order.reserve(n);
+  for (std::size_t id = 0; id < n; ++id) {
+    degree_[id] += nodes_[id].in.size();
+    if (degree_[id] == 0) {
+      order.emplace_back(id);
+    }
+  }
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    const std::size_t id = order[i];
+    const auto visit = [&](std::size_t v) {
+      if (--degree_[v] == 0) {
+        order.emplace_back(v);
+      }
+    };
+    for (DAGNode<K, V, Alloc>* v : nodes_[id].out) {
+      visit(v->id);
+    }
+    for (std::size_t j = offsets[id]; j < offsets[id + 1]; ++j) {
+      visit(targets[j]);
+    }
+  }
+  if (order.size() != n) {
+    return false;
+  }
+
+  for (auto [from, to] : links) {
+    LinkNodes(from, to);
+  }
+  reach_stale_ = true;
+  for (std::size_t i = 0; i < n; ++i) {
+    nodes_[order[i]].ord = i;
+  }
+  next_ord_ = n;
+  return true;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::RemoveNode(
+    const KeyLike& key) {
+  assert(allow_modify_);
+  const std::size_t* found = FindId(key);
+  if (!found) {
+    return false;
+  }
+  const std::size_t id = *found;
+  DAGNode<K, V, Alloc>& node = nodes_[id];
+  for (DAGNode<K, V, Alloc>* v : node.in) {
+    v->out.erase(&node);
+    if (v->out.empty()) {
+      tails_.emplace(v->k);
+    }
+  }
+  for (DAGNode<K, V, Alloc>* v : node.out) {
+    v->in.erase(&node);
+    if (v->in.empty()) {
+      heads_.emplace(v->k);
+    }
+  }
+  node.in.clear();
+  node.out.clear();
+
+  Vector<std::size_t> survivors(alloc_);
+  ComponentMembers(id, &survivors);
+  survivors.erase(std::find(std::begin(survivors), std::end(survivors), id));
+  RebuildComponents(std::move(survivors));
+  ReleaseNode(id);
+  return true;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename FromKey, typename ToKey>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::RemoveEdge(
+    const FromKey& from, const ToKey& to) {
+  assert(allow_modify_);
+  const std::size_t* from_id = FindId(from);
+  const std::size_t* to_id = FindId(to);
+  if (!from_id || !to_id || !nodes_[*from_id].out.erase(&nodes_[*to_id])) {
+    return false;
+  }
+  DAGNode<K, V, Alloc>& from_node = nodes_[*from_id];
+  DAGNode<K, V, Alloc>& to_node = nodes_[*to_id];
+  to_node.in.erase(&from_node);
+  InvalidateFrom(to_node.id);  // to lost an input
+  if (to_node.in.empty()) {
+    heads_.emplace(to_node.k);
+  }
+  if (from_node.out.empty()) {
+    tails_.emplace(from_node.k);
+  }
+  reach_stale_ = true;
+  Vector<std::size_t> members(alloc_);
+  ComponentMembers(from_node.id, &members);
+  RebuildComponents(std::move(members));
+  return true;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline DAGGraph<K, V, Alloc, Tracer, Index>
+DAGGraph<K, V, Alloc, Tracer, Index>::ExtractComponent(const KeyLike& key) {
+  assert(allow_modify_);
+  DAGGraph res(alloc_);
+  const std::size_t* id = FindId(key);
+  if (!id) {
+    return res;
+  }
+  Vector<std::size_t> members(alloc_);
+  ComponentMembers(*id, &members);
+  std::sort(std::begin(members), std::end(members));
+
+  Vector<std::pair<K, K>> edges(alloc_);
+  for (std::size_t id : members) {
+    DAGNode<K, V, Alloc>& node = res.InsertNode(nodes_[id].k);
+    node.v = std::move(nodes_[id].v);
+    node.cost = nodes_[id].cost;
+    node.resource_class = nodes_[id].resource_class;
+    for (DAGNode<K, V, Alloc>* v : nodes_[id].out) {
+      edges.emplace_back(nodes_[id].k, v->k);
+    }
+  }
+  [[maybe_unused]] const bool acyclic = res.AddEdges(edges);
+  assert(acyclic);
+
+  for (std::size_t id : members) {
+    nodes_[id].in.clear();
+    nodes_[id].out.clear();
+    ReleaseNode(id);
+  }
+  return res;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::TransitiveReduction() {
+  assert(allow_modify_);
+  Vector<std::size_t> position(nodes_.size(), alloc_);
+  Vector<std::uint64_t> closure(alloc_);
+  Vector<DAGNode<K, V, Alloc>*> out(alloc_);
+  Vector<std::uint64_t> acc(alloc_);
+  for (std::span<const std::size_t> seq : ConnectedComponents(false)) {
+    // successors come first, rows are indexed by position in seq
+    const std::size_t words = (seq.size() + 63) / 64;
+    closure.assign(seq.size() * words, 0);
+    for (std::size_t i = 0; i < seq.size(); ++i) {
+      DAGNode<K, V, Alloc>& node = nodes_[seq[i]];
+      position[node.id] = i;
+      // an edge is implied iff an earlier successor in topological order
+      // already reaches its target
+      out.assign(std::begin(node.out), std::end(node.out));
+      std::sort(std::begin(out), std::end(out),
+                [](DAGNode<K, V, Alloc>* lhs, DAGNode<K, V, Alloc>* rhs) {
+                  return lhs->ord < rhs->ord;
+                });
+      acc.assign(words, 0);
+      for (DAGNode<K, V, Alloc>* v : out) {
+        const std::size_t j = position[v->id];
+        if (acc[j / 64] >> (j % 64) & 1) {
+          node.out.erase(v);
+          v->in.erase(&node);
+          dirty_.emplace_back(node.id);
+          dirty_.emplace_back(v->id);
+          continue;
+        }
+        for (std::size_t w = 0; w < words; ++w) {
+          acc[w] |= closure[j * words + w];
+        }
+      }
+      acc[i / 64] |= std::uint64_t{1} << (i % 64);
+      std::copy(std::begin(acc), std::end(acc),
+                std::begin(closure) + i * words);
+    }
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::EnableReachabilityIndex(
+    bool enable) {
+  reach_enabled_ = enable;
+  reach_stale_ = true;
+  if (!enable) {
+    reach_.clear();
+    reach_.shrink_to_fit();
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename FromKey, typename ToKey>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::Reachable(const FromKey& from,
+                                                            const ToKey& to) {
+  const std::size_t* from_id = FindId(from);
+  const std::size_t* to_id = FindId(to);
+  if (!from_id || !to_id) {
+    return false;
+  }
+  if (reach_enabled_) {
+    if (reach_stale_) {
+      RebuildReachabilityIndex();
+    }
+    return ReachBit(*from_id, *to_id);
+  }
+
+  // nodes placed after the target in topological order cannot reach it
+  DAGNode<K, V, Alloc>* target = &nodes_[*to_id];
+  ++visit_mark_;
+  stack_.assign(1, &nodes_[*from_id]);
+  stack_.back()->mark = visit_mark_;
+  while (!stack_.empty()) {
+    DAGNode<K, V, Alloc>* node = stack_.back();
+    stack_.pop_back();
+    if (node == target) {
+      return true;
+    }
+    ForEachAdjacent(node->id, false, [&](std::size_t id) {
+      DAGNode<K, V, Alloc>* v = &nodes_[id];
+      if (v->mark != visit_mark_ && v->ord <= target->ord) {
+        v->mark = visit_mark_;
+        stack_.emplace_back(v);
+      }
+    });
+  }
+  return false;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::Exist(
+    const KeyLike& key) const {
+  return FindId(key);
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::SetCost(const KeyLike& key,
+                                                          double cost) {
+  const std::size_t* id = FindId(key);
+  assert(id);
+  nodes_[*id].cost = cost;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::SetResourceClass(
+    const KeyLike& key, std::size_t resource_class) {
+  const std::size_t* id = FindId(key);
+  assert(id && in_degree_for_next_.empty());
+  nodes_[*id].resource_class = resource_class;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::SetClassLimit(
+    std::size_t resource_class, std::size_t limit) {
+  assert(limit > 0 && in_degree_for_next_.empty());
+  if (class_limit_.size() <= resource_class) {
+    class_limit_.resize(resource_class + 1, kNoLimit);
+  }
+  class_limit_[resource_class] = limit;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::Clear() {
+  allow_modify_ = true;
+  bucket_.clear();
+  heads_.clear();
+  tails_.clear();
+  nodes_.clear();
+  free_ids_.clear();
+  next_ord_ = 0;
+  sequences_start_from_head_.clear();
+  sequences_start_from_tail_.clear();
+  component_first_.clear();
+  component_order_.clear();
+  free_components_.clear();
+  component_of_.clear();
+  component_parent_.clear();
+  component_size_.clear();
+  component_next_.clear();
+  dirty_.clear();
+  reach_.clear();
+  reach_stale_ = true;
+  marked_.clear();
+  marked_ids_.clear();
+  evaluated_.clear();
+  frozen_ = FrozenGraph(alloc_);
+  in_degree_for_next_.clear();
+  ready_for_next_.clear();
+  priority_for_next_.clear();
+  ready_count_for_next_ = 0;
+  ready_queue_for_next_ = decltype(ready_queue_for_next_)(alloc_);
+  started_for_next_.clear();
+  class_limit_.clear();
+  class_running_.clear();
+  class_waiting_.clear();
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline Alloc DAGGraph<K, V, Alloc, Tracer, Index>::get_allocator() const {
+  return alloc_;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline Tracer& DAGGraph<K, V, Alloc, Tracer, Index>::GetTracer() {
+  return tracer_;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::size_t DAGGraph<K, V, Alloc, Tracer, Index>::Size() const {
+  return bucket_.size();
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::Walk(
+    std::function<void(const K& k, const V& v)> f, bool start_from_head) {
+  Walk<const std::function<void(const K&, const V&)>&>(f, start_from_head);
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkHeads(
+    std::function<void(const K& k, const V& v)> f) {
+  WalkHeads<const std::function<void(const K&, const V&)>&>(f);
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkTails(
+    std::function<void(const K& k, const V& v)> f) {
+  WalkTails<const std::function<void(const K&, const V&)>&>(f);
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::Walk(F&& f,
+                                                       bool start_from_head) {
+  tracer_.Reset(nodes_.size());
+  ForEachInSequences(start_from_head, [&](std::size_t id) {
+    tracer_.Ready(id, KeyOf(id));
+    tracer_.Start(id, KeyOf(id));
+    f(KeyOf(id), std::as_const(*this).ValueOf(id));
+    tracer_.Finish(id, KeyOf(id));
+  });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkHeads(F&& f) {
+  ForEachInSequences(true, [&](std::size_t id) {
+    if (Degree(id, true) == 0) {
+      f(KeyOf(id), std::as_const(*this).ValueOf(id));
+    }
+  });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkTails(F&& f) {
+  ForEachInSequences(false, [&](std::size_t id) {
+    if (Degree(id, false) == 0) {
+      f(KeyOf(id), std::as_const(*this).ValueOf(id));
+    }
+  });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkMutable(
+    F&& f, bool start_from_head) {
+  tracer_.Reset(nodes_.size());
+  ForEachInSequences(start_from_head, [&](std::size_t id) {
+    tracer_.Ready(id, KeyOf(id));
+    tracer_.Start(id, KeyOf(id));
+    f(KeyOf(id), ValueOf(id));
+    tracer_.Finish(id, KeyOf(id));
+  });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::MarkDirty(
+    const KeyLike& key) {
+  const std::size_t* id = FindId(key);
+  if (!id) {
+    return false;
+  }
+  if (marked_.size() <= *id / 64) {
+    marked_.resize(nodes_.size() / 64 + 1);
+  }
+  std::uint64_t& word = marked_[*id / 64];
+  const std::uint64_t bit = std::uint64_t{1} << *id % 64;
+  if (!(word & bit)) {
+    word |= bit;
+    marked_ids_.emplace_back(*id);
+  }
+  return true;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkDirty(F&& f) {
+  if (marked_ids_.empty()) {
+    return;
+  }
+  marked_.resize(nodes_.size() / 64 + 1);  // nodes added since MarkDirty()
+  // marked_ids_ grows into the cone, a set bit means already queued
+  for (std::size_t i = 0; i < marked_ids_.size(); ++i) {
+    ForEachAdjacent(marked_ids_[i], false, [&](std::size_t v) {
+      std::uint64_t& word = marked_[v / 64];
+      const std::uint64_t bit = std::uint64_t{1} << v % 64;
+      if (!(word & bit)) {
+        word |= bit;
+        marked_ids_.emplace_back(v);
+      }
+    });
+  }
+  std::sort(std::begin(marked_ids_), std::end(marked_ids_),
+            [&](std::size_t lhs, std::size_t rhs) {
+              return nodes_[lhs].ord < nodes_[rhs].ord;
+            });
+  tracer_.Reset(nodes_.size());
+  for (std::size_t id : marked_ids_) {
+    marked_[id / 64] &= ~(std::uint64_t{1} << id % 64);
+  }
+  // f may mark nodes for the next WalkDirty()
+  Vector<std::size_t> cone(std::move(marked_ids_));
+  marked_ids_.clear();
+  for (std::size_t id : cone) {
+    tracer_.Ready(id, KeyOf(id));
+    tracer_.Start(id, KeyOf(id));
+    f(KeyOf(id), ValueOf(id));
+    tracer_.Finish(id, KeyOf(id));
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::WalkLevels(
+    F&& f, bool start_from_head) {
+  Vector<std::size_t> depth(nodes_.size(), 0, alloc_);
+  Vector<std::size_t> order(alloc_);
+  std::size_t levels = 0;
+  ForEachInSequences(start_from_head, [&](std::size_t id) {
+    ForEachAdjacent(id, start_from_head, [&](std::size_t v) {
+      depth[id] = std::max(depth[id], depth[v] + 1);
+    });
+    levels = std::max(levels, depth[id] + 1);
+    order.emplace_back(id);
+  });
+
+  // counting sort by depth keeps walk order inside a level
+  Vector<std::size_t> offsets(levels + 1, 0, alloc_);
+  for (std::size_t id : order) {
+    ++offsets[depth[id] + 1];
+  }
+  std::partial_sum(std::begin(offsets), std::end(offsets),
+                   std::begin(offsets));
+  Vector<std::size_t> cursor(std::begin(offsets), std::end(offsets) - 1,
+                             alloc_);
+  Vector<std::size_t> level_order(order.size(), alloc_);
+  for (std::size_t id : order) {
+    level_order[cursor[depth[id]]++] = id;
+  }
+
+  tracer_.Reset(nodes_.size());
+  Vector<K> keys(alloc_);
+  Vector<V*> values(alloc_);
+  for (std::size_t level = 0; level < levels; ++level) {
+    keys.clear();
+    values.clear();
+    for (std::size_t i = offsets[level]; i < offsets[level + 1]; ++i) {
+      keys.emplace_back(KeyOf(level_order[i]));
+      values.emplace_back(&ValueOf(level_order[i]));
+      tracer_.Ready(level_order[i], keys.back());
+      tracer_.Start(level_order[i], keys.back());
+    }
+    f(std::span<const K>(keys), std::span<V*>(values));
+    for (std::size_t i = offsets[level]; i < offsets[level + 1]; ++i) {
+      tracer_.Finish(level_order[i], KeyOf(level_order[i]));
+    }
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename Executor>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::ParallelWalk(
+    std::function<void(const K& k, const V& v)> f, Executor& executor,
+    bool start_from_head) {
+  Dispatch(executor, start_from_head,
+           [this, f](std::size_t id,
+                     std::function<void(std::exception_ptr)> done) {
+             std::exception_ptr error;
+             try {
+               f(KeyOf(id), ValueOf(id));
+             } catch (...) {
+               error = std::current_exception();
+             }
+             done(error);
+           });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F, typename Executor>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::AsyncWalk(
+    F f, Executor& executor, bool start_from_head) {
+  // coroutine lambdas refer to their closure, keep it alive until all done
+  Dispatch(executor, start_from_head,
+           [this, f = std::make_shared<F>(std::move(f))](
+               std::size_t id, std::function<void(std::exception_ptr)> done) {
+             // a plain function returning DAGTask may throw before any
+             // coroutine exists to report it
+             std::optional<DAGTask> task;
+             try {
+               task.emplace((*f)(KeyOf(id), ValueOf(id)));
+             } catch (...) {
+               done(std::current_exception());
+               return;
+             }
+             std::move(*task).Start(std::move(done));
+           });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename Executor>
+inline auto DAGGraph<K, V, Alloc, Tracer, Index>::ParallelTeardown(
+    std::function<void(const K& k, const V& v)> f, Executor& executor,
+    std::chrono::steady_clock::duration timeout)
+    -> std::vector<TeardownStage> {
+  using Clock = std::chrono::steady_clock;
+  using Deadline = std::pair<Clock::time_point, std::size_t>;
+  // TeardownStage without the key, so K needs no default constructor
+  struct Result {
+    Clock::duration duration{};
+    bool timed_out = false;
+    std::exception_ptr error;
+    bool ran = false;
+  };
+  struct State {
+    std::mutex m;
+    std::condition_variable cv;
+    // done of stages still holding their predecessors back
+    std::vector<std::function<void(std::exception_ptr)>> done;
+    std::vector<Result> results;
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<>>
+        deadlines;
+    std::size_t in_flight = 0;  // calls of f not yet returned
+    bool stop = false;
+  };
+  auto state = std::make_shared<State>();
+  state->done.resize(nodes_.size());
+  state->results.resize(nodes_.size());
+
+  // release the predecessors of stages past their deadline
+  std::thread watchdog([state] {
+    std::unique_lock<std::mutex> l(state->m);
+    while (!state->stop) {
+      if (state->deadlines.empty()) {
+        state->cv.wait(l);
+        continue;
+      }
+      const auto [deadline, id] = state->deadlines.top();
+      if (!state->done[id]) {  // returned in time
+        state->deadlines.pop();
+        continue;
+      }
+      if (Clock::now() < deadline) {
+        state->cv.wait_until(l, deadline);
+        continue;
+      }
+      state->deadlines.pop();
+      state->results[id].timed_out = true;
+      auto done = std::move(state->done[id]);
+      state->done[id] = nullptr;
+      l.unlock();
+      done(nullptr);
+      l.lock();
+    }
+  });
+
+  Dispatch(executor, false,
+           [this, f, timeout, state](
+               std::size_t id, std::function<void(std::exception_ptr)> done) {
+             const Clock::time_point start = Clock::now();
+             // saturate so duration::max() means no deadline
+             const Clock::time_point deadline =
+                 timeout < Clock::time_point::max() - start
+                     ? start + timeout
+                     : Clock::time_point::max();
+             {
+               std::lock_guard<std::mutex> l(state->m);
+               state->done[id] = std::move(done);
+               state->results[id].ran = true;
+               state->deadlines.emplace(deadline, id);
+               ++state->in_flight;
+             }
+             state->cv.notify_all();
+             std::exception_ptr error;
+             try {
+               f(KeyOf(id), ValueOf(id));
+             } catch (...) {
+               error = std::current_exception();
+             }
+             std::function<void(std::exception_ptr)> finish;
+             {
+               std::lock_guard<std::mutex> l(state->m);
+               Result& result = state->results[id];
+               result.duration = Clock::now() - start;
+               result.error = error;
+               finish = std::move(state->done[id]);
+               state->done[id] = nullptr;
+               --state->in_flight;
+             }
+             state->cv.notify_all();
+             if (finish) {
+               finish(nullptr);  // a failed stop does not block the rest
+             }
+           });
+  {
+    std::unique_lock<std::mutex> l(state->m);
+    state->cv.wait(l, [&] { return state->in_flight == 0; });
+    state->stop = true;
+  }
+  state->cv.notify_all();
+  watchdog.join();
+
+  std::vector<TeardownStage> res;
+  for (std::size_t id = 0; id < nodes_.size(); ++id) {
+    Result& result = state->results[id];
+    if (result.ran) {
+      res.emplace_back(TeardownStage{KeyOf(id), result.duration,
+                                     result.timed_out,
+                                     std::move(result.error)});
+    }
+  }
+  std::stable_sort(std::begin(res), std::end(res),
+                   [](const TeardownStage& lhs, const TeardownStage& rhs) {
+                     return lhs.duration > rhs.duration;
+                   });
+  return res;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike, typename F, typename Executor>
+inline V& DAGGraph<K, V, Alloc, Tracer, Index>::Get(const KeyLike& key,
+                                                   F f, Executor& executor) {
+  const std::size_t* found = FindId(key);
+  assert(found);
+  const std::size_t id = *found;
+  evaluated_.resize(nodes_.size());
+  // predecessors of an evaluated node are evaluated, stop the search there
+  Vector<std::size_t> cone(alloc_);
+  ++visit_mark_;
+  nodes_[id].mark = visit_mark_;
+  if (!evaluated_[id]) {
+    cone.emplace_back(id);
+  }
+  for (std::size_t i = 0; i < cone.size(); ++i) {
+    ForEachAdjacent(cone[i], true, [&](std::size_t v) {
+      if (nodes_[v].mark != visit_mark_ && !evaluated_[v]) {
+        nodes_[v].mark = visit_mark_;
+        cone.emplace_back(v);
+      }
+    });
+  }
+  if (!cone.empty()) {
+    Dispatch(
+        executor, true,
+        [this, &f](std::size_t v,
+                   std::function<void(std::exception_ptr)> done) {
+          std::exception_ptr error;
+          try {
+            f(KeyOf(v), ValueOf(v));
+          } catch (...) {
+            error = std::current_exception();
+          }
+          done(error);
+        },
+        cone);
+    // nothing is memoized if a node threw, Dispatch rethrew above
+    for (std::size_t v : cone) {
+      evaluated_[v] = true;
+    }
+  }
+  return ValueOf(id);
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::Invalidate(
+    const KeyLike& key) {
+  if (const std::size_t* id = FindId(key)) {
+    InvalidateFrom(*id);
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::unordered_set<K> DAGGraph<K, V, Alloc, Tracer, Index>::NextKeys(
+    SchedulePolicy policy) {
+  assert(in_degree_for_next_.empty());  // allowed call once unless Clear()
+  Freeze();
+  tracer_.Reset(nodes_.size());
+  in_degree_for_next_.resize(nodes_.size());
+  ready_for_next_.assign(nodes_.size(), false);
+  priority_for_next_.assign(nodes_.size(), 0);
+  started_for_next_.assign(nodes_.size(), false);
+  std::size_t classes = class_limit_.size();
+  for (const DAGNode<K, V, Alloc>& node : nodes_) {
+    classes = std::max(classes, node.resource_class + 1);
+  }
+  class_limit_.resize(classes, kNoLimit);
+  class_running_.assign(classes, 0);
+  while (class_waiting_.size() < classes) {
+    class_waiting_.emplace_back(Vector<ReadyEntry>(alloc_));
+  }
+  if (policy == SchedulePolicy::kCriticalPath) {
+    // successors come first when starting from tail
+    ForEachInSequences(false, [&](std::size_t id) {
+      double longest = 0;
+      ForEachAdjacent(id, false, [&](std::size_t v) {
+        longest = std::max(longest, priority_for_next_[v]);
+      });
+      priority_for_next_[id] = nodes_[id].cost + longest;
+    });
+  }
+  ForEachInSequences(true, [&](std::size_t id) {
+    in_degree_for_next_[id] = Degree(id, true);
+    if (in_degree_for_next_[id] == 0) {
+      tracer_.Ready(id, KeyOf(id));
+      ready_for_next_[id] = true;
+      ready_queue_for_next_.emplace(
+          priority_for_next_[id],
+          -static_cast<std::ptrdiff_t>(ready_count_for_next_++), id);
+    }
+  });
+  return std::unordered_set<K>(std::begin(heads_), std::end(heads_));
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::unordered_set<K> DAGGraph<K, V, Alloc, Tracer, Index>::NextKeys(
+    const K& key) {
+  assert(!allow_modify_);  // must call NextKeys() before
+  const std::size_t* found = FindId(key);
+  assert(found);
+  const std::size_t id = *found;
+  assert(ready_for_next_[id]);
+  ready_for_next_[id] = false;
+  tracer_.Finish(id, key);
+  if (started_for_next_[id]) {
+    // the freed place goes to the best waiting entry of the class
+    started_for_next_[id] = false;
+    const std::size_t c = nodes_[id].resource_class;
+    --class_running_[c];
+    Vector<ReadyEntry>& waiting = class_waiting_[c];
+    while (!waiting.empty()) {
+      std::pop_heap(std::begin(waiting), std::end(waiting));
+      const ReadyEntry entry = waiting.back();
+      waiting.pop_back();
+      if (ready_for_next_[std::get<2>(entry)]) {
+        ready_queue_for_next_.emplace(entry);
+        break;
+      }
+    }
+  }
+
+  std::unordered_set<K> res;
+  ForEachAdjacent(id, false, [&](std::size_t v) {
+    if (--in_degree_for_next_[v] == 0) {
+      tracer_.Ready(v, KeyOf(v));
+      ready_for_next_[v] = true;
+      ready_queue_for_next_.emplace(
+          priority_for_next_[v],
+          -static_cast<std::ptrdiff_t>(ready_count_for_next_++), v);
+      res.emplace(KeyOf(v));
+    }
+  });
+  return res;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::PopReadyKey(K* key) {
+  assert(!allow_modify_);  // must call NextKeys() before
+  while (!ready_queue_for_next_.empty()) {
+    const ReadyEntry entry = ready_queue_for_next_.top();
+    ready_queue_for_next_.pop();
+    const std::size_t id = std::get<2>(entry);
+    if (!ready_for_next_[id]) {  // skip keys already finished
+      continue;
+    }
+    const std::size_t c = nodes_[id].resource_class;
+    if (class_running_[c] == class_limit_[c]) {
+      // park it until a node of its class finishes, backfill from the rest
+      Vector<ReadyEntry>& waiting = class_waiting_[c];
+      waiting.emplace_back(entry);
+      std::push_heap(std::begin(waiting), std::end(waiting));
+      continue;
+    }
+    ++class_running_[c];
+    started_for_next_[id] = true;
+    *key = KeyOf(id);
+    tracer_.Start(id, *key);
+    return true;
+  }
+  return false;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline DAGGraph<K, V, Alloc, Tracer, Index>::ConcurrentSchedule::
+    ConcurrentSchedule(const DAGGraph& graph)
+    : graph_(graph),
+      in_degree_(new std::atomic<std::size_t>[graph.nodes_.size()]),
+      unfinished_(graph.Size()) {
+  assert(!graph_.allow_modify_);  // graph must be frozen
+  for (std::size_t id = 0; id < graph_.nodes_.size(); ++id) {
+    in_degree_[id].store(graph_.Degree(id, true), std::memory_order_relaxed);
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::vector<K>
+DAGGraph<K, V, Alloc, Tracer, Index>::ConcurrentSchedule::Heads() const {
+  std::vector<K> res;
+  for (std::size_t id = 0; id < graph_.nodes_.size(); ++id) {
+    if (graph_.nodes_[id].alive && graph_.Degree(id, true) == 0) {
+      res.emplace_back(graph_.KeyOf(id));
+    }
+  }
+  return res;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::vector<K>
+DAGGraph<K, V, Alloc, Tracer, Index>::ConcurrentSchedule::Complete(
+    const K& key) {
+  const std::size_t* found = graph_.FindId(key);
+  assert(found);
+  const std::size_t id = *found;
+  assert(in_degree_[id].load(std::memory_order_relaxed) == 0);
+  std::vector<K> res;
+  graph_.ForEachAdjacent(id, false, [&](std::size_t v) {
+    if (in_degree_[v].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      res.emplace_back(graph_.KeyOf(v));
+    }
+  });
+  unfinished_.fetch_sub(1, std::memory_order_release);
+  return res;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::ConcurrentSchedule::Done()
+    const {
+  return unfinished_.load(std::memory_order_acquire) == 0;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline typename DAGGraph<K, V, Alloc, Tracer, Index>::ConcurrentSchedule
+DAGGraph<K, V, Alloc, Tracer, Index>::MakeConcurrentSchedule() {
+  Freeze();
+  return ConcurrentSchedule{*this};
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline DAGNode<K, V, Alloc>& DAGGraph<K, V, Alloc, Tracer, Index>::InsertNode(
+    const KeyLike& key) {
+  std::size_t id = nodes_.size();
+  if (free_ids_.empty()) {
+    nodes_.emplace_back(alloc_);
+    component_of_.emplace_back();
+    component_parent_.emplace_back();
+    component_size_.emplace_back();
+    component_next_.emplace_back();
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  }
+  DAGNode<K, V, Alloc>& node = nodes_[id];
+  node.k = key;
+  node.id = id;
+  node.ord = next_ord_++;
+  node.cost = 1;
+  node.resource_class = 0;
+  node.alive = true;
+  component_of_[id] = kNoComponent;
+  component_parent_[id] = id;
+  component_size_[id] = 1;
+  component_next_[id] = id;
+  bucket_.emplace(node.k, id);
+  dirty_.emplace_back(id);
+  heads_.emplace(node.k);
+  tails_.emplace(node.k);
+  if (id >= reach_words_ * 64) {
+    reach_stale_ = true;
+  } else if (reach_enabled_ && !reach_stale_) {
+    // a fresh slot reaches only itself, freed columns were cleared when the
+    // removal made the index stale
+    std::fill_n(std::begin(reach_) + id * reach_words_, reach_words_, 0);
+    reach_[id * reach_words_ + id / 64] |= std::uint64_t{1} << (id % 64);
+  }
+  return node;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::LinkNodes(
+    DAGNode<K, V, Alloc>* from, DAGNode<K, V, Alloc>* to) {
+  if (from->out.emplace(to).second) {
+    to->in.emplace(from);
+    heads_.erase(to->k);
+    tails_.erase(from->k);
+    dirty_.emplace_back(from->id);
+    dirty_.emplace_back(to->id);
+    UnionComponents(from->id, to->id);
+    InvalidateFrom(to->id);  // to has a new input
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::InvalidateFrom(
+    std::size_t id) {
+  if (id >= evaluated_.size() || !evaluated_[id]) {
+    return;
+  }
+  // descendants of a node not evaluated are not evaluated either
+  Vector<std::size_t> stack(1, id, alloc_);
+  evaluated_[id] = false;
+  while (!stack.empty()) {
+    const std::size_t u = stack.back();
+    stack.pop_back();
+    ForEachAdjacent(u, false, [&](std::size_t v) {
+      if (evaluated_[v]) {
+        evaluated_[v] = false;
+        stack.emplace_back(v);
+      }
+    });
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::ReleaseNode(std::size_t id) {
+  DAGNode<K, V, Alloc>& node = nodes_[id];
+  bucket_.erase(node.k);
+  heads_.erase(node.k);
+  tails_.erase(node.k);
+  node.v = std::make_obj_using_allocator<V>(alloc_);
+  node.alive = false;
+  const std::size_t c = component_of_[id];
+  if (c != kNoComponent && !sequences_start_from_head_[c].empty()) {
+    sequences_start_from_head_[c].clear();
+    sequences_start_from_tail_[c].clear();
+    free_components_.emplace_back(c);
+    // walk order still lists the slot, make the next walk refresh it
+    dirty_.emplace_back(id);
+  }
+  component_of_[id] = kNoComponent;
+  free_ids_.emplace_back(id);
+  reach_stale_ = true;
+  if (id < evaluated_.size()) {
+    evaluated_[id] = false;
+  }
+  if (id / 64 < marked_.size() && (marked_[id / 64] >> id % 64 & 1)) {
+    marked_[id / 64] &= ~(std::uint64_t{1} << id % 64);
+    std::erase(marked_ids_, id);
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename KeyLike>
+inline const std::size_t* DAGGraph<K, V, Alloc, Tracer, Index>::FindId(
+    const KeyLike& key) const {
+  auto it = bucket_.find(key);
+  return it == std::end(bucket_) ? nullptr : &it->second;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::ReachBit(
+    std::size_t from, std::size_t to) const {
+  return reach_[from * reach_words_ + to / 64] >> (to % 64) & 1;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::ExtendReach(std::size_t from,
+                                                              std::size_t to) {
+  for (std::size_t id = 0; id < nodes_.size(); ++id) {
+    if (ReachBit(id, from)) {
+      for (std::size_t w = 0; w < reach_words_; ++w) {
+        reach_[id * reach_words_ + w] |= reach_[to * reach_words_ + w];
+      }
+    }
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::RebuildReachabilityIndex() {
+  reach_words_ = nodes_.size() / 64 + 1;
+  reach_.assign(reach_words_ * 64 * reach_words_, 0);
+  // successors come first when starting from tail
+  ForEachInSequences(false, [&](std::size_t id) {
+    reach_[id * reach_words_ + id / 64] |= std::uint64_t{1} << (id % 64);
+    ForEachAdjacent(id, false, [&](std::size_t v) {
+      for (std::size_t w = 0; w < reach_words_; ++w) {
+        reach_[id * reach_words_ + w] |= reach_[v * reach_words_ + w];
+      }
+    });
+  });
+  reach_stale_ = false;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::UpdateTopologicalOrder(
+    DAGNode<K, V, Alloc>* from, DAGNode<K, V, Alloc>* to) {
+  const std::size_t lower_bound = to->ord;
+  const std::size_t upper_bound = from->ord;
+  if (lower_bound > upper_bound) {
+    return true;
+  }
+
+  ++visit_mark_;
+  forward_.clear();
+  stack_.assign(1, to);
+  to->mark = visit_mark_;
+  while (!stack_.empty()) {
+    DAGNode<K, V, Alloc>* node = stack_.back();
+    stack_.pop_back();
+    forward_.emplace_back(node);
+    for (DAGNode<K, V, Alloc>* v : node->out) {
+      if (v == from) {
+        return false;
+      }
+      if (v->mark != visit_mark_ && v->ord < upper_bound) {
+        v->mark = visit_mark_;
+        stack_.emplace_back(v);
+      }
+    }
+  }
+
+  backward_.clear();
+  stack_.assign(1, from);
+  from->mark = visit_mark_;
+  while (!stack_.empty()) {
+    DAGNode<K, V, Alloc>* node = stack_.back();
+    stack_.pop_back();
+    backward_.emplace_back(node);
+    for (DAGNode<K, V, Alloc>* v : node->in) {
+      if (v->mark != visit_mark_ && v->ord > lower_bound) {
+        v->mark = visit_mark_;
+        stack_.emplace_back(v);
+      }
+    }
+  }
+
+  // ancestors of from take the smallest slots, descendants of to the rest
+  const auto by_ord = [](DAGNode<K, V, Alloc>* lhs, DAGNode<K, V, Alloc>* rhs) {
+    return lhs->ord < rhs->ord;
+  };
+  std::sort(std::begin(forward_), std::end(forward_), by_ord);
+  std::sort(std::begin(backward_), std::end(backward_), by_ord);
+  ords_.clear();
+  for (DAGNode<K, V, Alloc>* v : backward_) {
+    ords_.emplace_back(v->ord);
+  }
+  for (DAGNode<K, V, Alloc>* v : forward_) {
+    ords_.emplace_back(v->ord);
+  }
+  std::sort(std::begin(ords_), std::end(ords_));
+  std::size_t i = 0;
+  for (DAGNode<K, V, Alloc>* v : backward_) {
+    v->ord = ords_[i++];
+  }
+  for (DAGNode<K, V, Alloc>* v : forward_) {
+    v->ord = ords_[i++];
+  }
+  return true;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::RefreshWalkSequences() {
+  for (std::size_t id : dirty_) {
+    const std::size_t c = component_of_[id];
+    if (c != kNoComponent && !sequences_start_from_head_[c].empty()) {
+      sequences_start_from_head_[c].clear();
+      sequences_start_from_tail_[c].clear();
+      free_components_.emplace_back(c);
+    }
+  }
+
+  ++visit_mark_;
+  degree_.resize(nodes_.size());
+  for (std::size_t id : dirty_) {
+    if (!nodes_[id].alive) {
+      continue;
+    }
+    const std::size_t root = FindComponent(id);
+    if (nodes_[root].mark == visit_mark_) {
+      continue;
+    }
+    nodes_[root].mark = visit_mark_;
+    members_.clear();
+    ComponentMembers(root, &members_);
+    std::sort(std::begin(members_), std::end(members_));
+
+    std::size_t c = sequences_start_from_head_.size();
+    if (free_components_.empty()) {
+      sequences_start_from_head_.emplace_back(Vector<std::size_t>(alloc_));
+      sequences_start_from_tail_.emplace_back(Vector<std::size_t>(alloc_));
+      component_first_.emplace_back();
+    } else {
+      c = free_components_.back();
+      free_components_.pop_back();
+    }
+    sequences_start_from_head_[c] = TopologicalSequence(members_, true);
+    sequences_start_from_tail_[c] = TopologicalSequence(members_, false);
+    component_first_[c] = members_.front();
+    for (std::size_t v : members_) {
+      component_of_[v] = c;
+    }
+  }
+  dirty_.clear();
+
+  component_order_.clear();
+  for (std::size_t c = 0; c < sequences_start_from_head_.size(); ++c) {
+    if (!sequences_start_from_head_[c].empty()) {
+      component_order_.emplace_back(c);
+    }
+  }
+  std::sort(std::begin(component_order_), std::end(component_order_),
+            [&](std::size_t lhs, std::size_t rhs) {
+              const std::size_t lhs_size = sequences_start_from_head_[lhs].size();
+              const std::size_t rhs_size = sequences_start_from_head_[rhs].size();
+              return lhs_size != rhs_size
+                         ? lhs_size < rhs_size
+                         : component_first_[lhs] < component_first_[rhs];
+            });
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename Executor, typename Run>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::Dispatch(
+    Executor& executor, bool start_from_head, Run run,
+    std::span<const std::size_t> ids) {
+  struct State {
+    std::unique_ptr<std::atomic<std::size_t>[]> pending;
+    std::unique_ptr<bool[]> member;  // null when all nodes are scheduled
+    std::size_t running = 0;
+    std::exception_ptr error;
+    std::mutex m;
+    std::condition_variable cv;
+  };
+  auto state = std::make_shared<State>();
+  state->pending.reset(new std::atomic<std::size_t>[nodes_.size()]);
+  if (ids.empty()) {
+    for (std::size_t id = 0; id < nodes_.size(); ++id) {
+      state->pending[id] = Degree(id, start_from_head);
+    }
+  } else {
+    state->member.reset(new bool[nodes_.size()]());
+    for (std::size_t id : ids) {
+      state->member[id] = true;
+    }
+    for (std::size_t id : ids) {
+      std::size_t pending = 0;
+      ForEachAdjacent(id, start_from_head,
+                      [&](std::size_t v) { pending += state->member[v]; });
+      state->pending[id] = pending;
+    }
+  }
+  tracer_.Reset(nodes_.size());
+
+  auto start = std::make_shared<std::function<void(std::size_t)>>();
+  *start = [this, run, &executor, start_from_head, state,
+            weak_start = std::weak_ptr(start)](std::size_t id) {
+    tracer_.Start(id, KeyOf(id));
+    run(id, [this, &executor, start_from_head, state, weak_start,
+             id](std::exception_ptr error) {
+      tracer_.Finish(id, KeyOf(id));
+      std::vector<std::size_t> ready;
+      if (!error) {
+        ForEachAdjacent(id, !start_from_head, [&](std::size_t v) {
+          if ((!state->member || state->member[v]) &&
+              --state->pending[v] == 0) {
+            tracer_.Ready(v, KeyOf(v));
+            ready.emplace_back(v);
+          }
+        });
+      }
+      {
+        std::lock_guard<std::mutex> l(state->m);
+        if (error && !state->error) {
+          state->error = error;
+        }
+        state->running += ready.size();
+      }
+      // submit unlocked since an executor may run the task on this thread,
+      // and before the decrement below so Dispatch() outlives the submits
+      if (auto start = weak_start.lock()) {
+        for (std::size_t v : ready) {
+          executor.Submit([start, v] { (*start)(v); });
+        }
+      }
+      std::lock_guard<std::mutex> l(state->m);
+      if (--state->running == 0) {
+        state->cv.notify_all();
+      }
+    });
+  };
+
+  // pending drops once the first node runs, find the roots beforehand
+  Vector<std::size_t> roots(alloc_);
+  if (ids.empty()) {
+    ForEachInSequences(start_from_head, [&](std::size_t id) {
+      if (Degree(id, start_from_head) == 0) {
+        roots.emplace_back(id);
+      }
+    });
+  } else {
+    std::ranges::copy_if(ids, std::back_inserter(roots), [&](std::size_t id) {
+      return state->pending[id] == 0;
+    });
+  }
+  {
+    std::lock_guard<std::mutex> l(state->m);
+    state->running = roots.size();
+  }
+  for (std::size_t id : roots) {
+    tracer_.Ready(id, KeyOf(id));
+    executor.Submit([start, id] { (*start)(id); });
+  }
+  std::unique_lock<std::mutex> l(state->m);
+  state->cv.wait(l, [&] { return state->running == 0; });
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline auto DAGGraph<K, V, Alloc, Tracer, Index>::ConnectedComponents(
+    bool start_from_head) -> Vector<std::span<const std::size_t>> {
+  if (!dirty_.empty()) {
+    RefreshWalkSequences();
+  }
+  const Vector<Vector<std::size_t>>& seqs =
+      start_from_head ? sequences_start_from_head_ : sequences_start_from_tail_;
+  Vector<std::span<const std::size_t>> res(alloc_);
+  res.reserve(component_order_.size());
+  for (std::size_t c : component_order_) {
+    res.emplace_back(seqs[c]);
+  }
+  return res;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::ForEachInSequences(
+    bool start_from_head, F&& f) {
+  if (!dirty_.empty()) {
+    RefreshWalkSequences();
+  }
+  const Vector<Vector<std::size_t>>& seqs =
+      start_from_head ? sequences_start_from_head_ : sequences_start_from_tail_;
+  for (std::size_t c : component_order_) {
+    for (std::size_t id : seqs[c]) {
+      f(id);
+    }
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::Freeze() {
+  if (!allow_modify_) {
+    return;
+  }
+  if (!dirty_.empty()) {
+    RefreshWalkSequences();
+  }
+
+  const std::size_t n = nodes_.size();
+  frozen_ = FrozenGraph(alloc_);
+  frozen_.keys.reserve(n);
+  frozen_.values.reserve(n);
+  frozen_.in_offsets.reserve(n + 1);
+  frozen_.out_offsets.reserve(n + 1);
+  frozen_.in_offsets.emplace_back(0);
+  frozen_.out_offsets.emplace_back(0);
+  for (DAGNode<K, V, Alloc>& node : nodes_) {
+    frozen_.keys.emplace_back(node.k);
+    frozen_.values.emplace_back(std::move(node.v));
+    for (DAGNode<K, V, Alloc>* v : node.in) {
+      frozen_.in.emplace_back(v->id);
+    }
+    for (DAGNode<K, V, Alloc>* v : node.out) {
+      frozen_.out.emplace_back(v->id);
+    }
+    frozen_.in_offsets.emplace_back(frozen_.in.size());
+    frozen_.out_offsets.emplace_back(frozen_.out.size());
+  }
+  allow_modify_ = false;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline bool DAGGraph<K, V, Alloc, Tracer, Index>::Save(
+    const std::string& path) {
+  static_assert(sizeof(std::size_t) == sizeof(std::uint64_t));
+  using KeyCodec = SnapshotCodec<K>;
+  using ValueCodec = SnapshotCodec<V>;
+  using Header = DAGSnapshotHeader;
+  Freeze();
+
+  Vector<typename KeyCodec::Encoded> keys(alloc_);
+  Vector<typename ValueCodec::Encoded> values(alloc_);
+  keys.reserve(nodes_.size());
+  values.reserve(nodes_.size());
+  for (std::size_t id = 0; id < nodes_.size(); ++id) {
+    keys.emplace_back(KeyCodec::Encode(frozen_.keys[id]));
+    values.emplace_back(ValueCodec::Encode(frozen_.values[id]));
+  }
+  Vector<std::size_t> head_sequence(alloc_);
+  Vector<std::size_t> tail_sequence(alloc_);
+  ForEachInSequences(true, [&](std::size_t id) {
+    head_sequence.emplace_back(id);
+  });
+  ForEachInSequences(false, [&](std::size_t id) {
+    tail_sequence.emplace_back(id);
+  });
+  Vector<std::size_t> key_index(alloc_);
+  for (const auto& [k, id] : bucket_) {
+    key_index.emplace_back(id);
+  }
+  std::sort(std::begin(key_index), std::end(key_index),
+            [&](std::size_t lhs, std::size_t rhs) {
+              return KeyOf(lhs) < KeyOf(rhs);
+            });
+
+  struct Section {
+    const void* data;
+    std::size_t count;
+    std::size_t size;
+  };
+  constexpr std::size_t kId = sizeof(std::size_t);
+  const Section sections[] = {
+      {keys.data(), keys.size(), sizeof(keys[0])},
+      {values.data(), values.size(), sizeof(values[0])},
+      {frozen_.in_offsets.data(), frozen_.in_offsets.size(), kId},
+      {frozen_.in.data(), frozen_.in.size(), kId},
+      {frozen_.out_offsets.data(), frozen_.out_offsets.size(), kId},
+      {frozen_.out.data(), frozen_.out.size(), kId},
+      {head_sequence.data(), head_sequence.size(), kId},
+      {tail_sequence.data(), tail_sequence.size(), kId},
+      {key_index.data(), key_index.size(), kId},
+  };
+  static_assert(std::size(sections) == Header::kSectionCount);
+  Header header{};
+  std::memcpy(header.magic, Header::kMagic, sizeof(header.magic));
+  header.key_size = sizeof(typename KeyCodec::Encoded);
+  header.value_size = sizeof(typename ValueCodec::Encoded);
+  std::uint64_t end = sizeof(header);
+  for (std::size_t i = 0; i < Header::kSectionCount; ++i) {
+    header.offset[i] = (end + Header::kAlignment - 1) / Header::kAlignment *
+                       Header::kAlignment;
+    header.count[i] = sections[i].count;
+    end = header.offset[i] + sections[i].count * sections[i].size;
+  }
+
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  std::uint64_t pos = sizeof(header);
+  for (std::size_t i = 0; i < Header::kSectionCount; ++i) {
+    const char padding[Header::kAlignment] = {};
+    os.write(padding, header.offset[i] - pos);
+    pos = header.offset[i] + sections[i].count * sections[i].size;
+    os.write(static_cast<const char*>(sections[i].data),
+             sections[i].count * sections[i].size);
+  }
+  return static_cast<bool>(os.flush());
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline const K& DAGGraph<K, V, Alloc, Tracer, Index>::KeyOf(
+    std::size_t id) const {
+  return allow_modify_ ? nodes_[id].k : frozen_.keys[id];
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline const V& DAGGraph<K, V, Alloc, Tracer, Index>::ValueOf(
+    std::size_t id) const {
+  return allow_modify_ ? nodes_[id].v : frozen_.values[id];
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline V& DAGGraph<K, V, Alloc, Tracer, Index>::ValueOf(std::size_t id) {
+  return allow_modify_ ? nodes_[id].v : frozen_.values[id];
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::size_t DAGGraph<K, V, Alloc, Tracer, Index>::Degree(std::size_t id,
+                                                                bool in) const {
+  if (allow_modify_) {
+    return in ? nodes_[id].in.size() : nodes_[id].out.size();
+  }
+  const Vector<std::size_t>& offsets =
+      in ? frozen_.in_offsets : frozen_.out_offsets;
+  return offsets[id + 1] - offsets[id];
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+template <typename F>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::ForEachAdjacent(
+    std::size_t id, bool in, F&& f) const {
+  if (allow_modify_) {
+    for (DAGNode<K, V, Alloc>* v : in ? nodes_[id].in : nodes_[id].out) {
+      f(v->id);
+    }
+    return;
+  }
+  const Vector<std::size_t>& offsets =
+      in ? frozen_.in_offsets : frozen_.out_offsets;
+  const Vector<std::size_t>& adjacency = in ? frozen_.in : frozen_.out;
+  for (std::size_t i = offsets[id]; i < offsets[id + 1]; ++i) {
+    f(adjacency[i]);
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline std::size_t DAGGraph<K, V, Alloc, Tracer, Index>::FindComponent(
+    std::size_t id) {
+  while (component_parent_[id] != id) {
+    component_parent_[id] = component_parent_[component_parent_[id]];
+    id = component_parent_[id];
+  }
+  return id;
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::UnionComponents(
+    std::size_t lhs, std::size_t rhs) {
+  lhs = FindComponent(lhs);
+  rhs = FindComponent(rhs);
+  if (lhs == rhs) {
+    return;
+  }
+  if (component_size_[lhs] < component_size_[rhs]) {
+    std::swap(lhs, rhs);
+  }
+  component_parent_[rhs] = lhs;
+  component_size_[lhs] += component_size_[rhs];
+  std::swap(component_next_[lhs], component_next_[rhs]);  // splice lists
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::ComponentMembers(
+    std::size_t id, Vector<std::size_t>* members) {
+  const std::size_t root = FindComponent(id);
+  std::size_t v = root;
+  do {
+    members->emplace_back(v);
+    v = component_next_[v];
+  } while (v != root);
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline void DAGGraph<K, V, Alloc, Tracer, Index>::RebuildComponents(
+    Vector<std::size_t> ids) {
+  for (std::size_t id : ids) {
+    component_parent_[id] = id;
+    component_size_[id] = 1;
+    component_next_[id] = id;
+    dirty_.emplace_back(id);
+  }
+  for (std::size_t id : ids) {
+    for (DAGNode<K, V, Alloc>* v : nodes_[id].out) {
+      UnionComponents(id, v->id);
+    }
+  }
+}
+
+template <typename K, typename V, typename Alloc, typename Tracer,
+          typename Index>
+inline auto DAGGraph<K, V, Alloc, Tracer, Index>::TopologicalSequence(
+    const Vector<std::size_t>& connected_component, bool start_from_head)
+    -> Vector<std::size_t> {
+  // res doubles as the FIFO queue of Kahn's algorithm
+  Vector<std::size_t> res(alloc_);
+  res.reserve(connected_component.size());
+  for (std::size_t id : connected_component) {
+    degree_[id] = Degree(id, start_from_head);
+    if (degree_[id] == 0) {
+      res.emplace_back(id);
+    }
+  }
+  for (std::size_t i = 0; i < res.size(); ++i) {
+    ForEachAdjacent(res[i], !start_from_head, [&](std::size_t v) {
+      if (--degree_[v] == 0) {
+        res.emplace_back(v);
+      }
+    });
+  }
+
+  assert(res.size() == connected_component.size());  // graph is DAG
+  return res;
+}
+
+// Read-only view of a file written by DAGGraph::Save(), mapped into memory
+// so adjacency and walk order are usable without parsing
+template <typename K, typename V>
+class DAGSnapshot {
+ public:
+  DAGSnapshot() = default;
+
+  DAGSnapshot(const DAGSnapshot&) = delete;
+
+  DAGSnapshot(DAGSnapshot&& rhs) noexcept;
+
+  DAGSnapshot& operator=(const DAGSnapshot&) = delete;
+
+  DAGSnapshot& operator=(DAGSnapshot&& rhs) noexcept;
+
+  ~DAGSnapshot();
+
+  // False if the file is missing, truncated, saved for other K and V, or
+  // holds an offset or slot id out of range, checked in one pass over it
+  bool Open(const std::string& path);
+
+  std::size_t Size() const;
+
+  // Slot id of key for In(), Out(), Key() and Value()
+  bool Find(const K& key, std::size_t* id) const;
+
+  K Key(std::size_t id) const;
+
+  V Value(std::size_t id) const;
+
+  std::span<const std::uint64_t> In(std::size_t id) const;
+
+  std::span<const std::uint64_t> Out(std::size_t id) const;
+
+  // Same order as DAGGraph::Walk() at the time of Save()
+  template <typename F>
+  void Walk(F&& f, bool start_from_head = true) const;
+
+ private:
+  using Header = DAGSnapshotHeader;
+  using KeyRecord = typename SnapshotCodec<K>::Encoded;
+  using ValueRecord = typename SnapshotCodec<V>::Encoded;
+
+  const Header& GetHeader() const;
+
+  template <typename T>
+  std::span<const T> GetSection(Header::Section section) const;
+
+  // Offsets run from 0 to the size of ids without decreasing
+  bool ValidOffsets(Header::Section offsets, Header::Section ids) const;
+
+  // Every entry of section is a slot id below slots
+  bool ValidIds(Header::Section section, std::size_t slots) const;
+
+  void Close();
+
+ private:
+  void* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+template <typename K, typename V>
+inline DAGSnapshot<K, V>::DAGSnapshot(DAGSnapshot&& rhs) noexcept
+    : data_(std::exchange(rhs.data_, nullptr)),
+      size_(std::exchange(rhs.size_, 0)) {}
+
+template <typename K, typename V>
+inline DAGSnapshot<K, V>& DAGSnapshot<K, V>::operator=(
+    DAGSnapshot&& rhs) noexcept {
+  if (this != &rhs) {
+    Close();
+    data_ = std::exchange(rhs.data_, nullptr);
+    size_ = std::exchange(rhs.size_, 0);
+  }
+  return *this;
+}
+
+template <typename K, typename V>
+inline DAGSnapshot<K, V>::~DAGSnapshot() {
+  Close();
+}
+
+template <typename K, typename V>
+inline bool DAGSnapshot<K, V>::Open(const std::string& path) {
+  Close();
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (::fstat(fd, &st) == 0 &&
+      static_cast<std::size_t>(st.st_size) >= sizeof(Header)) {
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      data_ = data;
+      size_ = st.st_size;
+    }
+  }
+  ::close(fd);
+  if (!data_) {
+    return false;
+  }
+
+  const Header& header = GetHeader();
+  bool valid =
+      std::memcmp(header.magic, Header::kMagic, sizeof(header.magic)) == 0 &&
+      header.key_size == sizeof(KeyRecord) &&
+      header.value_size == sizeof(ValueRecord);
+  const std::size_t sizes[] = {sizeof(KeyRecord), sizeof(ValueRecord)};
+  for (std::size_t i = 0; valid && i < Header::kSectionCount; ++i) {
+    const std::size_t size = i < Header::kInOffsets ? sizes[i]
+                                                     : sizeof(std::uint64_t);
+    valid = header.offset[i] % Header::kAlignment == 0 &&
+            header.offset[i] <= size_ &&
+            header.count[i] <= (size_ - header.offset[i]) / size;
+  }
+  const std::size_t slots = header.count[Header::kKeys];
+  const std::size_t live = header.count[Header::kKeyIndex];
+  valid = valid && header.count[Header::kValues] == slots &&
+          header.count[Header::kInOffsets] == slots + 1 &&
+          header.count[Header::kOutOffsets] == slots + 1 &&
+          header.count[Header::kHeadSequence] == live &&
+          header.count[Header::kTailSequence] == live && live <= slots &&
+          ValidOffsets(Header::kInOffsets, Header::kIn) &&
+          ValidOffsets(Header::kOutOffsets, Header::kOut) &&
+          ValidIds(Header::kIn, slots) && ValidIds(Header::kOut, slots) &&
+          ValidIds(Header::kHeadSequence, slots) &&
+          ValidIds(Header::kTailSequence, slots) &&
+          ValidIds(Header::kKeyIndex, slots);
+  if (!valid) {
+    Close();
+  }
+  return valid;
+}
+
+template <typename K, typename V>
+inline std::size_t DAGSnapshot<K, V>::Size() const {
+  return GetHeader().count[Header::kKeyIndex];
+}
+
+template <typename K, typename V>
+inline bool DAGSnapshot<K, V>::Find(const K& key, std::size_t* id) const {
+  const std::span<const std::uint64_t> index =
+      GetSection<std::uint64_t>(Header::kKeyIndex);
+  auto it = std::lower_bound(
+      std::begin(index), std::end(index), key,
+      [&](std::uint64_t lhs, const K& rhs) { return Key(lhs) < rhs; });
+  if (it == std::end(index) || key < Key(*it)) {
+    return false;
+  }
+  *id = *it;
+  return true;
+}
+
+template <typename K, typename V>
+inline K DAGSnapshot<K, V>::Key(std::size_t id) const {
+  return SnapshotCodec<K>::Decode(GetSection<KeyRecord>(Header::kKeys)[id]);
+}
+
+template <typename K, typename V>
+inline V DAGSnapshot<K, V>::Value(std::size_t id) const {
+  return SnapshotCodec<V>::Decode(
+      GetSection<ValueRecord>(Header::kValues)[id]);
+}
+
+template <typename K, typename V>
+inline std::span<const std::uint64_t> DAGSnapshot<K, V>::In(
+    std::size_t id) const {
+  const std::span<const std::uint64_t> offsets =
+      GetSection<std::uint64_t>(Header::kInOffsets);
+  return GetSection<std::uint64_t>(Header::kIn)
+      .subspan(offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+template <typename K, typename V>
+inline std::span<const std::uint64_t> DAGSnapshot<K, V>::Out(
+    std::size_t id) const {
+  const std::span<const std::uint64_t> offsets =
+      GetSection<std::uint64_t>(Header::kOutOffsets);
+  return GetSection<std::uint64_t>(Header::kOut)
+      .subspan(offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+template <typename K, typename V>
+template <typename F>
+inline void DAGSnapshot<K, V>::Walk(F&& f, bool start_from_head) const {
+  for (std::uint64_t id : GetSection<std::uint64_t>(
+           start_from_head ? Header::kHeadSequence : Header::kTailSequence)) {
+    f(Key(id), Value(id));
+  }
+}
+
+template <typename K, typename V>
+inline const DAGSnapshotHeader& DAGSnapshot<K, V>::GetHeader() const {
+  assert(data_);
+  return *static_cast<const Header*>(data_);
+}
+
+template <typename K, typename V>
+template <typename T>
+inline std::span<const T> DAGSnapshot<K, V>::GetSection(
+    Header::Section section) const {
+  const Header& header = GetHeader();
+  return {reinterpret_cast<const T*>(static_cast<const char*>(data_) +
+                                     header.offset[section]),
+          header.count[section]};
+}
+
+template <typename K, typename V>
+inline bool DAGSnapshot<K, V>::ValidOffsets(Header::Section offsets,
+                                            Header::Section ids) const {
+  const std::span<const std::uint64_t> entries =
+      GetSection<std::uint64_t>(offsets);
+  return entries.front() == 0 && entries.back() == GetHeader().count[ids] &&
+         std::is_sorted(std::begin(entries), std::end(entries));
+}
+
+template <typename K, typename V>
+inline bool DAGSnapshot<K, V>::ValidIds(Header::Section section,
+                                        std::size_t slots) const {
+  const std::span<const std::uint64_t> ids = GetSection<std::uint64_t>(section);
+  return std::all_of(std::begin(ids), std::end(ids),
+                     [&](std::uint64_t id) { return id < slots; });
+}
+
+template <typename K, typename V>
+inline void DAGSnapshot<K, V>::Close() {
+  if (data_) {
+    ::munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+namespace pmr {
+
+template <typename K, typename V>
+using DAGGraph =
+    jc::DAGGraph<K, V, std::pmr::polymorphic_allocator<std::byte>>;
+
+}  // namespace pmr
+
+// Graph owning its arena: nodes, edge sets and caches are carved out of
+// Resource and released at once on destruction, erased slots are not
+// returned with the default monotonic resource, use a pool resource for
+// graphs that churn
+template <typename K, typename V,
+          typename Resource = std::pmr::monotonic_buffer_resource>
+class ArenaDAGGraph : private Resource, public pmr::DAGGraph<K, V> {
+ public:
+  template <typename... Args>
+  explicit ArenaDAGGraph(Args&&... args)
+      : Resource(std::forward<Args>(args)...),
+        pmr::DAGGraph<K, V>(static_cast<Resource*>(this)) {}
+
+  ArenaDAGGraph(const ArenaDAGGraph&) = delete;
+
+  ArenaDAGGraph& operator=(const ArenaDAGGraph&) = delete;
+};
+
+}  // namespace jc
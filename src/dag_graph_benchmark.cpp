@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "allocation_counter.hpp"
+#include "dag_graph.hpp"
+
+namespace jc::benchmark {
+
+// Wall time of f in seconds
+template <typename F>
+double Seconds(F&& f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const auto finish = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(finish - start).count();
+}
+
+// Edges from each node to fan_in distinct nodes of the layer above
+std::vector<std::pair<int, int>> LayeredEdges(int nodes_count, int width,
+                                              int fan_in) {
+  std::vector<std::pair<int, int>> edges;
+  edges.reserve(static_cast<std::size_t>(nodes_count) * fan_in);
+  for (int to = width; to < nodes_count; ++to) {
+    const int layer = to / width * width;
+    for (int i = 0; i < fan_in; ++i) {
+      edges.emplace_back(layer - width + (to + i * 337) % width, to);
+    }
+  }
+  return edges;
+}
+
+// 1M edges in random order into a layered DAG whose nodes were inserted
+// shuffled within runs of window layers, with one layer per window
+// AddEdge() never has to reorder, wider windows make it repair the
+// topological order more often and over larger regions
+void AddEdgeThroughput(int window) {
+  constexpr int width = 1000;
+  constexpr int fan_in = 3;
+  constexpr int edges_count = 1000000;
+  constexpr int nodes_count = width + edges_count / fan_in;
+  std::mt19937 rng(1);
+  std::vector<int> keys(nodes_count);
+  std::iota(std::begin(keys), std::end(keys), 0);
+  for (int i = 0; i < nodes_count; i += window * width) {
+    std::shuffle(std::begin(keys) + i,
+                 std::begin(keys) + std::min(nodes_count, i + window * width),
+                 rng);
+  }
+  std::vector<std::pair<int, int>> edges =
+      LayeredEdges(nodes_count, width, fan_in);
+  std::shuffle(std::begin(edges), std::end(edges), rng);
+
+  DAGGraph<int, int> g;
+  for (int key : keys) {
+    g[key] = key;
+  }
+  const double seconds = Seconds([&] {
+    for (auto [from, to] : edges) {
+      g.AddEdge(from, to);
+    }
+  });
+  std::printf(
+      "{\"benchmark\":\"add_edge\",\"shape\":\"layered\",\"nodes\":%d,"
+      "\"edges\":%zu,\"shuffle_window_layers\":%d,\"seconds\":%.6f,"
+      "\"edges_per_second\":%.0f}\n",
+      nodes_count, edges.size(), window, seconds,
+      static_cast<double>(edges.size()) / seconds);
+}
+
+// Run f in a child process so the peak RSS it reports is its own
+template <typename F>
+void InChildProcess(F&& f) {
+  std::fflush(stdout);
+  const pid_t pid = ::fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    f();
+    std::fflush(stdout);
+    std::_Exit(0);
+  }
+  int status = 0;
+  ::waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+enum class Shape {
+  kLayered,     // layers of 100 nodes, 3 edges into each from the one above
+  kFanOut,      // 8 roots feeding every other node
+  kChain,       // one path through all nodes
+  kComponents,  // diamonds of 4 nodes with no edges between them
+};
+
+const char* ShapeName(Shape shape) {
+  switch (shape) {
+    case Shape::kLayered:
+      return "layered";
+    case Shape::kFanOut:
+      return "fan_out";
+    case Shape::kChain:
+      return "chain";
+    case Shape::kComponents:
+      return "components";
+  }
+  return "";
+}
+
+std::vector<std::pair<int, int>> ShapeEdges(Shape shape, int nodes_count) {
+  std::vector<std::pair<int, int>> edges;
+  switch (shape) {
+    case Shape::kLayered:
+      return LayeredEdges(nodes_count, 100, 3);
+    case Shape::kFanOut:
+      for (int to = 8; to < nodes_count; ++to) {
+        edges.emplace_back(to % 8, to);
+      }
+      break;
+    case Shape::kChain:
+      for (int to = 1; to < nodes_count; ++to) {
+        edges.emplace_back(to - 1, to);
+      }
+      break;
+    case Shape::kComponents:
+      for (int base = 0; base + 3 < nodes_count; base += 4) {
+        edges.emplace_back(base, base + 1);
+        edges.emplace_back(base, base + 2);
+        edges.emplace_back(base + 1, base + 3);
+        edges.emplace_back(base + 2, base + 3);
+      }
+      break;
+  }
+  return edges;
+}
+
+// Build a graph of the shape in key order, then time AddEdge(), the first
+// Walk() which computes the walk sequences, a second Walk(), and a full
+// PopReadyKey() / NextKeys(key) schedule, with the allocations per node of
+// the build and the peak RSS of the process
+void Scale(Shape shape, int nodes_count) {
+  const std::vector<std::pair<int, int>> edges =
+      ShapeEdges(shape, nodes_count);
+  const std::size_t allocations_before = global_allocations;
+  DAGGraph<int, int> g;
+  for (int i = 0; i < nodes_count; ++i) {
+    g[i] = i;
+  }
+  const double add_edge_seconds = Seconds([&] {
+    for (auto [from, to] : edges) {
+      g.AddEdge(from, to);
+    }
+  });
+  const std::size_t allocations = global_allocations - allocations_before;
+  long long sum = 0;
+  const auto add = [&sum](int, int v) { sum += v; };
+  const double first_walk_seconds = Seconds([&] { g.Walk(add); });
+  const double walk_seconds = Seconds([&] { g.Walk(add); });
+  assert(sum == static_cast<long long>(nodes_count) * (nodes_count - 1));
+  int scheduled = 0;
+  const double schedule_seconds = Seconds([&] {
+    g.NextKeys();
+    int key = 0;
+    while (g.PopReadyKey(&key)) {
+      g.NextKeys(key);
+      ++scheduled;
+    }
+  });
+  assert(scheduled == nodes_count);
+  rusage usage{};
+  ::getrusage(RUSAGE_SELF, &usage);
+  std::printf(
+      "{\"benchmark\":\"scale\",\"shape\":\"%s\",\"nodes\":%d,"
+      "\"edges\":%zu,\"add_edge_seconds\":%.6f,\"edges_per_second\":%.0f,"
+      "\"first_walk_seconds\":%.6f,\"walk_seconds\":%.6f,"
+      "\"schedule_seconds\":%.6f,\"allocations_per_node\":%.2f,"
+      "\"peak_rss_kb\":%ld}\n",
+      ShapeName(shape), nodes_count, edges.size(), add_edge_seconds,
+      static_cast<double>(edges.size()) / add_edge_seconds,
+      first_walk_seconds, walk_seconds, schedule_seconds,
+      static_cast<double>(allocations) / nodes_count, usage.ru_maxrss);
+}
+
+// The scan based NextKeys(key) replaced by per node in-degree counters,
+// kept as the baseline: each completion erases the key from the unfinished
+// walk order and searches it again for every predecessor of every successor
+class ScanSchedule {
+ public:
+  ScanSchedule(std::vector<int> sequence,
+               const std::vector<std::pair<int, int>>& edges)
+      : sequence_(std::move(sequence)),
+        in_(sequence_.size()),
+        out_(sequence_.size()) {
+    for (auto [from, to] : edges) {
+      in_[to].emplace_back(from);
+      out_[from].emplace_back(to);
+    }
+  }
+
+  std::vector<int> Complete(int key) {
+    sequence_.erase(std::find(std::begin(sequence_), std::end(sequence_), key));
+    std::vector<int> res;
+    for (int v : out_[key]) {
+      const bool ready = std::none_of(
+          std::begin(in_[v]), std::end(in_[v]), [&](int u) {
+            return std::find(std::begin(sequence_), std::end(sequence_), u) !=
+                   std::end(sequence_);
+          });
+      if (ready) {
+        res.emplace_back(v);
+      }
+    }
+    return res;
+  }
+
+ private:
+  std::vector<int> sequence_;
+  std::vector<std::vector<int>> in_;
+  std::vector<std::vector<int>> out_;
+};
+
+// Complete every node of a 100k node layered DAG in FIFO order, with the
+// in-degree counters of NextKeys(key) and with the old scan
+void ScheduleCompletionCost() {
+  constexpr int nodes_count = 100000;
+  const std::vector<std::pair<int, int>> edges =
+      LayeredEdges(nodes_count, 100, 3);
+  DAGGraph<int, int> g;
+  for (int i = 0; i < nodes_count; ++i) {
+    g[i] = i;
+  }
+  for (auto [from, to] : edges) {
+    g.AddEdge(from, to);
+  }
+  std::vector<int> sequence;
+  g.Walk([&](int key, int) { sequence.emplace_back(key); });
+  ScanSchedule scan(sequence, edges);
+  const std::unordered_set<int> heads = g.NextKeys();
+  const auto run = [&](const char* name, auto&& complete) {
+    std::size_t completions = 0;
+    const double seconds = Seconds([&] {
+      std::deque<int> ready(std::begin(heads), std::end(heads));
+      while (!ready.empty()) {
+        for (int v : complete(ready.front())) {
+          ready.emplace_back(v);
+        }
+        ready.pop_front();
+        ++completions;
+      }
+    });
+    assert(completions == nodes_count);
+    std::printf(
+        "{\"benchmark\":\"next_keys\",\"schedule\":\"%s\",\"nodes\":%d,"
+        "\"seconds\":%.6f,\"ns_per_completion\":%.1f}\n",
+        name, nodes_count, seconds, seconds * 1e9 / completions);
+  };
+  run("in_degree", [&](int key) { return g.NextKeys(key); });
+  run("scan", [&](int key) { return scan.Complete(key); });
+}
+
+// Per node cost of Walk() over a 1M node chain through the std::function
+// overload and through the template one, best of 5 walks each, on the
+// linked layout and again after NextKeys() packed the graph
+void WalkOverloadOverhead() {
+  constexpr int nodes_count = 1000000;
+  DAGGraph<int, int> g;
+  for (int i = 0; i < nodes_count; ++i) {
+    g[i] = i;
+  }
+  for (int i = 1; i < nodes_count; ++i) {
+    g.AddEdge(i - 1, i);
+  }
+  long long sum = 0;
+  const auto add = [&sum](int, int v) { sum += v; };
+  const std::function<void(const int&, const int&)> erased = add;
+  const auto run = [&](const char* layout, const char* overload,
+                       auto&& walk) {
+    double best = 1e9;
+    for (int i = 0; i < 5; ++i) {
+      best = std::min(best, Seconds(walk));
+    }
+    std::printf(
+        "{\"benchmark\":\"walk_overload\",\"shape\":\"chain\","
+        "\"layout\":\"%s\",\"overload\":\"%s\",\"nodes\":%d,"
+        "\"ns_per_node\":%.2f}\n",
+        layout, overload, nodes_count, best * 1e9 / nodes_count);
+  };
+  run("linked", "std_function", [&] { g.Walk(erased); });
+  run("linked", "template", [&] { g.Walk(add); });
+  g.NextKeys();
+  run("frozen", "std_function", [&] { g.Walk(erased); });
+  run("frozen", "template", [&] { g.Walk(add); });
+  assert(sum == 20LL * nodes_count * (nodes_count - 1) / 2);
+}
+
+// Makespan of running g on workers with the given policy, each node takes
+// its cost in simulated time
+double SimulateMakespan(DAGGraph<int, int>& g,
+                        DAGGraph<int, int>::SchedulePolicy policy,
+                        const std::vector<double>& costs, std::size_t workers) {
+  g.NextKeys(policy);
+  std::multimap<double, int> running;  // finish time to key
+  double now = 0;
+  int key = 0;
+  while (true) {
+    while (running.size() < workers && g.PopReadyKey(&key)) {
+      running.emplace(now + costs[key], key);
+    }
+    if (running.empty()) {
+      return now;
+    }
+    now = running.begin()->first;
+    g.NextKeys(running.begin()->second);
+    running.erase(running.begin());
+  }
+}
+
+// Random DAGs of mostly cheap stages with a few expensive ones, FIFO
+// against critical path priorities, lower_bound is the larger of the
+// longest cost path and the total cost spread over all workers
+void CriticalPathMakespan() {
+  using SchedulePolicy = DAGGraph<int, int>::SchedulePolicy;
+  constexpr int nodes_count = 5000;
+  for (std::uint32_t seed : {1u, 2u, 3u}) {
+    std::mt19937 rng(seed);
+    std::vector<double> costs(nodes_count);
+    for (double& cost : costs) {
+      cost = rng() % 10 == 0 ? 10 + rng() % 40 : 1;
+    }
+    std::vector<std::pair<int, int>> edges;
+    for (int to = 1; to < nodes_count; ++to) {
+      for (int i = 0; i < 2; ++i) {
+        edges.emplace_back(to - 1 - rng() % std::min(to, 200), to);
+      }
+    }
+    std::vector<double> longest = costs;  // edges lead to larger keys
+    for (auto [from, to] : edges) {
+      longest[to] = std::max(longest[to], longest[from] + costs[to]);
+    }
+    const double critical_path =
+        *std::max_element(std::begin(longest), std::end(longest));
+    const double total =
+        std::accumulate(std::begin(costs), std::end(costs), 0.0);
+    for (std::size_t workers : {4, 16, 64}) {
+      double makespan[2];
+      for (SchedulePolicy policy :
+           {SchedulePolicy::kFifo, SchedulePolicy::kCriticalPath}) {
+        DAGGraph<int, int> g;
+        for (int i = 0; i < nodes_count; ++i) {
+          g[i] = i;
+          g.SetCost(i, costs[i]);
+        }
+        for (auto [from, to] : edges) {
+          g.AddEdge(from, to);
+        }
+        makespan[policy == SchedulePolicy::kCriticalPath] =
+            SimulateMakespan(g, policy, costs, workers);
+      }
+      std::printf(
+          "{\"benchmark\":\"makespan\",\"nodes\":%d,\"seed\":%u,"
+          "\"workers\":%zu,\"fifo\":%.0f,\"critical_path\":%.0f,"
+          "\"lower_bound\":%.0f}\n",
+          nodes_count, seed, workers, makespan[0], makespan[1],
+          std::max(critical_path, total / workers));
+    }
+  }
+}
+
+}  // namespace jc::benchmark
+
+// The optional argument caps the node count of the scale runs, 1M by
+// default, pass 10000000 for the 10M runs whose layered shape takes 8 GB
+int main(int argc, char* argv[]) {
+  using jc::benchmark::Shape;
+  const int max_nodes = argc > 1 ? std::atoi(argv[1]) : 1000000;
+  for (Shape shape : {Shape::kLayered, Shape::kFanOut, Shape::kChain,
+                      Shape::kComponents}) {
+    for (int nodes_count = 1000; nodes_count <= max_nodes; nodes_count *= 10) {
+      jc::benchmark::InChildProcess(
+          [&] { jc::benchmark::Scale(shape, nodes_count); });
+    }
+  }
+  for (int window : {1, 2, 8}) {
+    jc::benchmark::AddEdgeThroughput(window);
+  }
+  jc::benchmark::ScheduleCompletionCost();
+  jc::benchmark::WalkOverloadOverhead();
+  jc::benchmark::CriticalPathMakespan();
+}
\ No newline at end of file
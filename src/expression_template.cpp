@@ -1,261 +1,11 @@
 #include <cassert>
 #include <cstddef>
+#include <stdexcept>
 #include <type_traits>
+#include <vector>
 
-namespace jc {
-
-template <typename T>
-class SArray {
- public:
-  explicit SArray(std::size_t sz) : data_(new T[sz]), sz_(sz) { init(); }
-
-  SArray(const SArray<T>& rhs) : data_(new T[rhs.sz_]), sz_(rhs.sz_) {
-    copy(rhs);
-  }
-
-  SArray<T>& operator=(const SArray<T>& rhs) {
-    if (&rhs != this) {
-      copy(rhs);
-    }
-    return *this;
-  }
-
-  ~SArray() { delete[] data_; }
-
-  std::size_t size() const { return sz_; }
-
-  T& operator[](std::size_t i) { return data_[i]; }
-
-  const T& operator[](std::size_t i) const { return data_[i]; }
-
-  SArray<T>& operator+=(const SArray<T>& rhs) {
-    assert(sz_ == rhs.sz_);
-    for (std::size_t i = 0; i < sz_; ++i) {
-      (*this)[i] += rhs[i];
-    }
-    return *this;
-  }
-
-  SArray<T>& operator*=(const SArray<T>& rhs) {
-    assert(sz_ == rhs.sz_);
-    for (std::size_t i = 0; i < sz_; ++i) {
-      (*this)[i] *= rhs[i];
-    }
-    return *this;
-  }
-
-  SArray<T>& operator*=(const T& rhs) {
-    for (std::size_t i = 0; i < sz_; ++i) {
-      (*this)[i] *= rhs;
-    }
-    return *this;
-  }
-
- protected:
-  void init() {
-    for (std::size_t i = 0; i < sz_; ++i) {
-      data_[i] = T{};
-    }
-  }
-
-  void copy(const SArray<T>& rhs) {
-    assert(sz_ == rhs.sz_);
-    for (std::size_t i = 0; i < sz_; ++i) {
-      data_[i] = rhs.data_[i];
-    }
-  }
-
- private:
-  T* data_;
-  std::size_t sz_;
-};
-
-template <typename T>
-SArray<T> operator+(const SArray<T>& lhs, const SArray<T>& rhs) {
-  assert(lhs.size() == rhs.size());
-  SArray<T> res{lhs.size()};
-  for (std::size_t i = 0; i < lhs.size(); ++i) {
-    res[i] = lhs[i] + rhs[i];
-  }
-  return res;
-}
-
-template <typename T>
-SArray<T> operator*(const SArray<T>& lhs, const SArray<T>& rhs) {
-  assert(lhs.size() == rhs.size());
-  SArray<T> res{lhs.size()};
-  for (std::size_t i = 0; i < lhs.size(); ++i) {
-    res[i] = lhs[i] * rhs[i];
-  }
-  return res;
-}
-
-template <typename T>
-SArray<T> operator*(const T& lhs, const SArray<T>& rhs) {
-  SArray<T> res{rhs.size()};
-  for (std::size_t i = 0; i < rhs.size(); ++i) {
-    res[i] = lhs * rhs[i];
-  }
-  return res;
-}
-
-template <typename T>
-class A_Scalar {
- public:
-  constexpr A_Scalar(const T& v) : value_(v) {}
-
-  constexpr const T& operator[](std::size_t) const { return value_; }
-
-  constexpr std::size_t size() const { return 0; };
-
- private:
-  const T& value_;
-};
-
-template <typename T>
-struct A_Traits {
-  using type = const T&;
-};
-
-template <typename T>
-struct A_Traits<A_Scalar<T>> {
-  using type = A_Scalar<T>;
-};
-
-template <typename T, typename OP1, typename OP2>
-class A_Add {
- public:
-  A_Add(const OP1& op1, const OP2& op2) : op1_(op1), op2_(op2) {}
-
-  T operator[](std::size_t i) const { return op1_[i] + op2_[i]; }
-
-  std::size_t size() const {
-    assert(op1_.size() == 0 || op2_.size() == 0 || op1_.size() == op2_.size());
-    return op1_.size() != 0 ? op1_.size() : op2_.size();
-  }
-
- private:
-  typename A_Traits<OP1>::type op1_;
-  typename A_Traits<OP2>::type op2_;
-};
-
-template <typename T, typename OP1, typename OP2>
-class A_Mult {
- public:
-  A_Mult(const OP1& op1, const OP2& op2) : op1_(op1), op2_(op2) {}
-
-  T operator[](std::size_t i) const { return op1_[i] * op2_[i]; }
-
-  std::size_t size() const {
-    assert(op1_.size() == 0 || op2_.size() == 0 || op1_.size() == op2_.size());
-    return op1_.size() != 0 ? op1_.size() : op2_.size();
-  }
-
- private:
-  typename A_Traits<OP1>::type op1_;
-  typename A_Traits<OP2>::type op2_;
-};
-
-template <typename T, typename A1, typename A2>
-class A_Subscript {
- public:
-  A_Subscript(const A1& a1, const A2& a2) : a1_(a1), a2_(a2) {}
-
-  T& operator[](std::size_t i) {
-    return const_cast<T&>(a1_[static_cast<std::size_t>(a2_[i])]);
-  }
-
-  decltype(auto) operator[](std::size_t i) const {
-    return a1_[static_cast<std::size_t>(a2_[i])];
-  }
-
-  std::size_t size() const { return a2_.size(); }
-
- private:
-  const A1& a1_;
-  const A2& a2_;
-};
-
-}  // namespace jc
-
-namespace jc::test {
-
-template <typename T, typename Rep = SArray<T>>
-class Array {
- public:
-  explicit Array(std::size_t i) : r_(i) {}
-
-  Array(const Rep& rhs) : r_(rhs) {}
-
-  Array& operator=(const Array& rhs) {
-    assert(size() == rhs.size());
-    for (std::size_t i = 0; i < rhs.size(); ++i) {
-      r_[i] = rhs[i];
-    }
-    return *this;
-  }
-
-  template <typename T2, typename Rep2>
-  Array& operator=(const Array<T2, Rep2>& rhs) {
-    assert(size() == rhs.size());
-    for (std::size_t i = 0; i < rhs.size(); ++i) {
-      r_[i] = rhs[i];
-    }
-    return *this;
-  }
-
-  std::size_t size() const { return r_.size(); }
-
-  T& operator[](std::size_t i) {
-    assert(i < size());
-    return r_[i];
-  }
-
-  decltype(auto) operator[](std::size_t i) const {
-    assert(i < size());
-    return r_[i];
-  }
-
-  template <typename T2, typename Rep2>
-  Array<T, A_Subscript<T, Rep, Rep2>> operator[](const Array<T2, Rep2>& rhs) {
-    return Array<T, A_Subscript<T, Rep, Rep2>>{
-        A_Subscript<T, Rep, Rep2>{this->rep(), rhs.rep()}};
-  }
-
-  template <typename T2, typename Rep2>
-  decltype(auto) operator[](const Array<T2, Rep2>& rhs) const {
-    return Array<T, A_Subscript<T, Rep, Rep2>>{
-        A_Subscript<T, Rep, Rep2>{this->rep(), rhs.rep()}};
-  }
-
-  Rep& rep() { return r_; }
-
-  const Rep& rep() const { return r_; }
-
- private:
-  Rep r_;
-};
-
-template <typename T, typename R1, typename R2>
-Array<T, A_Add<T, R1, R2>> operator+(const Array<T, R1>& lhs,
-                                     const Array<T, R2>& rhs) {
-  return Array<T, A_Add<T, R1, R2>>{A_Add<T, R1, R2>{lhs.rep(), rhs.rep()}};
-}
-
-template <typename T, typename R1, typename R2>
-Array<T, A_Mult<T, R1, R2>> operator*(const Array<T, R1>& lhs,
-                                      const Array<T, R2>& rhs) {
-  return Array<T, A_Mult<T, R1, R2>>{A_Mult<T, R1, R2>{lhs.rep(), rhs.rep()}};
-}
-
-template <typename T, typename R2>
-Array<T, A_Mult<T, A_Scalar<T>, R2>> operator*(const T& lhs,
-                                               const Array<T, R2>& rhs) {
-  return Array<T, A_Mult<T, A_Scalar<T>, R2>>{
-      A_Mult<T, A_Scalar<T>, R2>{A_Scalar<T>(lhs), rhs.rep()}};
-}
-
-}  // namespace jc::test
+#include "expression_template.hpp"
+#include "thread_pool.hpp"
 
 int main() {
   constexpr std::size_t sz = 1000;
@@ -304,4 +54,63 @@ int main() {
   for (std::size_t i = 0; i < sz; ++i) {
     assert(x[i] == 2.0 * (1.2 * a + a * b));
   }
+
+  // packets and the scalar tail agree with a hand written loop
+  constexpr std::size_t odd_sz = 1003;
+  static_assert(jc::HasLoadPacket<jc::A_Add<
+                    double, jc::A_Mult<double, jc::A_Scalar<double>,
+                                       jc::SArray<double>>,
+                    jc::SArray<double>>>::value);
+  static_assert(!jc::HasLoadPacket<
+                jc::A_Subscript<double, jc::SArray<double>,
+                                jc::SArray<double>>>::value);
+  jc::test::Array<double> u{odd_sz};
+  jc::test::Array<double> v{odd_sz};
+  std::vector<double> expected(odd_sz);
+  for (std::size_t i = 0; i < odd_sz; ++i) {
+    u[i] = static_cast<double>(i) / 8;
+    v[i] = static_cast<double>(odd_sz - i);
+    expected[i] = u[i] * v[i] + u[i];
+  }
+  u = u * v + u;
+  for (std::size_t i = 0; i < odd_sz; ++i) {
+    assert(u[i] == expected[i]);
+  }
+
+  // several chunks and a partial last one, each evaluated on the pool, with
+  // operands whose products and sums are exact in double, so the results do
+  // not depend on whether the compiler contracts them into FMA
+  constexpr std::size_t large_sz = 100003;
+  jc::test::Array<double> p{large_sz};
+  jc::test::Array<double> q{large_sz};
+  for (std::size_t i = 0; i < large_sz; ++i) {
+    p[i] = static_cast<double>(i);
+    q[i] = 3;
+  }
+  jc::ThreadPool pool{4};
+  p.assign_parallel(0.5 * p + p * q, pool);
+  for (std::size_t i = 0; i < large_sz; ++i) {
+    const double old = static_cast<double>(i);
+    assert(p[i] == 0.5 * old + old * 3);
+  }
+
+  // a throwing chunk is rethrown once the others are done
+  struct ThrowingRep {
+    std::size_t size() const { return large_sz; }
+
+    double operator[](std::size_t i) const {
+      if (i == large_sz / 2) {
+        throw std::runtime_error("bad element");
+      }
+      return 0;
+    }
+  };
+  bool thrown = false;
+  try {
+    p.assign_parallel(jc::test::Array<double, ThrowingRep>{ThrowingRep{}},
+                      pool);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown && p[0] == 0 && p[large_sz - 1] == 0);
 }
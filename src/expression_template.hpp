@@ -0,0 +1,493 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <latch>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace jc {
+
+// Widest SIMD register the target offers for T, one element if none
+template <typename T>
+class Packet {
+ public:
+  static constexpr std::size_t size = 1;
+
+  static Packet load(const T* p) { return Packet{*p}; }
+
+  static Packet broadcast(const T& v) { return Packet{v}; }
+
+  void store(T* p) const { *p = v_; }
+
+  friend Packet operator+(const Packet& lhs, const Packet& rhs) {
+    return Packet{lhs.v_ + rhs.v_};
+  }
+
+  friend Packet operator*(const Packet& lhs, const Packet& rhs) {
+    return Packet{lhs.v_ * rhs.v_};
+  }
+
+ private:
+  explicit Packet(const T& v) : v_(v) {}
+
+ private:
+  T v_;
+};
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__) || \
+    (defined(__ARM_NEON) && defined(__aarch64__))
+template <>
+class Packet<double> {
+ public:
+#if defined(__AVX512F__)
+  using Register = __m512d;
+  static constexpr std::size_t size = 8;
+#elif defined(__AVX__)
+  using Register = __m256d;
+  static constexpr std::size_t size = 4;
+#elif defined(__SSE2__)
+  using Register = __m128d;
+  static constexpr std::size_t size = 2;
+#else
+  using Register = float64x2_t;
+  static constexpr std::size_t size = 2;
+#endif
+
+  static Packet load(const double* p) {
+#if defined(__AVX512F__)
+    return Packet{_mm512_loadu_pd(p)};
+#elif defined(__AVX__)
+    return Packet{_mm256_loadu_pd(p)};
+#elif defined(__SSE2__)
+    return Packet{_mm_loadu_pd(p)};
+#else
+    return Packet{vld1q_f64(p)};
+#endif
+  }
+
+  static Packet broadcast(double v) {
+#if defined(__AVX512F__)
+    return Packet{_mm512_set1_pd(v)};
+#elif defined(__AVX__)
+    return Packet{_mm256_set1_pd(v)};
+#elif defined(__SSE2__)
+    return Packet{_mm_set1_pd(v)};
+#else
+    return Packet{vdupq_n_f64(v)};
+#endif
+  }
+
+  void store(double* p) const {
+#if defined(__AVX512F__)
+    _mm512_storeu_pd(p, v_);
+#elif defined(__AVX__)
+    _mm256_storeu_pd(p, v_);
+#elif defined(__SSE2__)
+    _mm_storeu_pd(p, v_);
+#else
+    vst1q_f64(p, v_);
+#endif
+  }
+
+  friend Packet operator+(const Packet& lhs, const Packet& rhs) {
+#if defined(__AVX512F__)
+    return Packet{_mm512_add_pd(lhs.v_, rhs.v_)};
+#elif defined(__AVX__)
+    return Packet{_mm256_add_pd(lhs.v_, rhs.v_)};
+#elif defined(__SSE2__)
+    return Packet{_mm_add_pd(lhs.v_, rhs.v_)};
+#else
+    return Packet{vaddq_f64(lhs.v_, rhs.v_)};
+#endif
+  }
+
+  friend Packet operator*(const Packet& lhs, const Packet& rhs) {
+#if defined(__AVX512F__)
+    return Packet{_mm512_mul_pd(lhs.v_, rhs.v_)};
+#elif defined(__AVX__)
+    return Packet{_mm256_mul_pd(lhs.v_, rhs.v_)};
+#elif defined(__SSE2__)
+    return Packet{_mm_mul_pd(lhs.v_, rhs.v_)};
+#else
+    return Packet{vmulq_f64(lhs.v_, rhs.v_)};
+#endif
+  }
+
+ private:
+  explicit Packet(Register v) : v_(v) {}
+
+ private:
+  Register v_;
+};
+#endif
+
+// Whether Rep reads (writes) Packet<T>::size elements at once from index i
+template <typename Rep, typename = void>
+struct HasLoadPacket : std::false_type {};
+
+template <typename Rep>
+struct HasLoadPacket<
+    Rep, std::void_t<decltype(std::declval<const Rep&>().load_packet(0))>>
+    : std::true_type {};
+
+template <typename Rep, typename = void>
+struct HasStorePacket : std::false_type {};
+
+template <typename Rep>
+struct HasStorePacket<
+    Rep, std::void_t<decltype(std::declval<Rep&>().store_packet(
+             0, std::declval<const Rep&>().load_packet(0)))>>
+    : std::true_type {};
+
+template <typename T>
+class SArray {
+ public:
+  explicit SArray(std::size_t sz) : data_(new T[sz]), sz_(sz) { init(); }
+
+  SArray(const SArray<T>& rhs) : data_(new T[rhs.sz_]), sz_(rhs.sz_) {
+    copy(rhs);
+  }
+
+  SArray<T>& operator=(const SArray<T>& rhs) {
+    if (&rhs != this) {
+      copy(rhs);
+    }
+    return *this;
+  }
+
+  ~SArray() { delete[] data_; }
+
+  std::size_t size() const { return sz_; }
+
+  T& operator[](std::size_t i) { return data_[i]; }
+
+  const T& operator[](std::size_t i) const { return data_[i]; }
+
+  Packet<T> load_packet(std::size_t i) const {
+    return Packet<T>::load(data_ + i);
+  }
+
+  void store_packet(std::size_t i, const Packet<T>& p) { p.store(data_ + i); }
+
+  SArray<T>& operator+=(const SArray<T>& rhs) {
+    assert(sz_ == rhs.sz_);
+    for (std::size_t i = 0; i < sz_; ++i) {
+      (*this)[i] += rhs[i];
+    }
+    return *this;
+  }
+
+  SArray<T>& operator*=(const SArray<T>& rhs) {
+    assert(sz_ == rhs.sz_);
+    for (std::size_t i = 0; i < sz_; ++i) {
+      (*this)[i] *= rhs[i];
+    }
+    return *this;
+  }
+
+  SArray<T>& operator*=(const T& rhs) {
+    for (std::size_t i = 0; i < sz_; ++i) {
+      (*this)[i] *= rhs;
+    }
+    return *this;
+  }
+
+ protected:
+  void init() {
+    for (std::size_t i = 0; i < sz_; ++i) {
+      data_[i] = T{};
+    }
+  }
+
+  void copy(const SArray<T>& rhs) {
+    assert(sz_ == rhs.sz_);
+    for (std::size_t i = 0; i < sz_; ++i) {
+      data_[i] = rhs.data_[i];
+    }
+  }
+
+ private:
+  T* data_;
+  std::size_t sz_;
+};
+
+template <typename T>
+SArray<T> operator+(const SArray<T>& lhs, const SArray<T>& rhs) {
+  assert(lhs.size() == rhs.size());
+  SArray<T> res{lhs.size()};
+  for (std::size_t i = 0; i < lhs.size(); ++i) {
+    res[i] = lhs[i] + rhs[i];
+  }
+  return res;
+}
+
+template <typename T>
+SArray<T> operator*(const SArray<T>& lhs, const SArray<T>& rhs) {
+  assert(lhs.size() == rhs.size());
+  SArray<T> res{lhs.size()};
+  for (std::size_t i = 0; i < lhs.size(); ++i) {
+    res[i] = lhs[i] * rhs[i];
+  }
+  return res;
+}
+
+template <typename T>
+SArray<T> operator*(const T& lhs, const SArray<T>& rhs) {
+  SArray<T> res{rhs.size()};
+  for (std::size_t i = 0; i < rhs.size(); ++i) {
+    res[i] = lhs * rhs[i];
+  }
+  return res;
+}
+
+template <typename T>
+class A_Scalar {
+ public:
+  constexpr A_Scalar(const T& v) : value_(v) {}
+
+  constexpr const T& operator[](std::size_t) const { return value_; }
+
+  Packet<T> load_packet(std::size_t) const {
+    return Packet<T>::broadcast(value_);
+  }
+
+  constexpr std::size_t size() const { return 0; };
+
+ private:
+  const T& value_;
+};
+
+template <typename T>
+struct A_Traits {
+  using type = const T&;
+};
+
+template <typename T>
+struct A_Traits<A_Scalar<T>> {
+  using type = A_Scalar<T>;
+};
+
+template <typename T, typename OP1, typename OP2>
+class A_Add {
+ public:
+  A_Add(const OP1& op1, const OP2& op2) : op1_(op1), op2_(op2) {}
+
+  T operator[](std::size_t i) const { return op1_[i] + op2_[i]; }
+
+  template <typename OP = OP1,
+            std::enable_if_t<HasLoadPacket<OP>::value &&
+                                 HasLoadPacket<OP2>::value,
+                             int> = 0>
+  Packet<T> load_packet(std::size_t i) const {
+    return op1_.load_packet(i) + op2_.load_packet(i);
+  }
+
+  std::size_t size() const {
+    assert(op1_.size() == 0 || op2_.size() == 0 || op1_.size() == op2_.size());
+    return op1_.size() != 0 ? op1_.size() : op2_.size();
+  }
+
+ private:
+  typename A_Traits<OP1>::type op1_;
+  typename A_Traits<OP2>::type op2_;
+};
+
+template <typename T, typename OP1, typename OP2>
+class A_Mult {
+ public:
+  A_Mult(const OP1& op1, const OP2& op2) : op1_(op1), op2_(op2) {}
+
+  T operator[](std::size_t i) const { return op1_[i] * op2_[i]; }
+
+  template <typename OP = OP1,
+            std::enable_if_t<HasLoadPacket<OP>::value &&
+                                 HasLoadPacket<OP2>::value,
+                             int> = 0>
+  Packet<T> load_packet(std::size_t i) const {
+    return op1_.load_packet(i) * op2_.load_packet(i);
+  }
+
+  std::size_t size() const {
+    assert(op1_.size() == 0 || op2_.size() == 0 || op1_.size() == op2_.size());
+    return op1_.size() != 0 ? op1_.size() : op2_.size();
+  }
+
+ private:
+  typename A_Traits<OP1>::type op1_;
+  typename A_Traits<OP2>::type op2_;
+};
+
+template <typename T, typename A1, typename A2>
+class A_Subscript {
+ public:
+  A_Subscript(const A1& a1, const A2& a2) : a1_(a1), a2_(a2) {}
+
+  T& operator[](std::size_t i) {
+    return const_cast<T&>(a1_[static_cast<std::size_t>(a2_[i])]);
+  }
+
+  decltype(auto) operator[](std::size_t i) const {
+    return a1_[static_cast<std::size_t>(a2_[i])];
+  }
+
+  std::size_t size() const { return a2_.size(); }
+
+ private:
+  const A1& a1_;
+  const A2& a2_;
+};
+
+}  // namespace jc
+
+namespace jc::test {
+
+template <typename T, typename Rep = SArray<T>>
+class Array {
+ public:
+  explicit Array(std::size_t i) : r_(i) {}
+
+  Array(const Rep& rhs) : r_(rhs) {}
+
+  Array& operator=(const Array& rhs) {
+    assert(size() == rhs.size());
+    for (std::size_t i = 0; i < rhs.size(); ++i) {
+      r_[i] = rhs[i];
+    }
+    return *this;
+  }
+
+  template <typename T2, typename Rep2>
+  Array& operator=(const Array<T2, Rep2>& rhs) {
+    assert(size() == rhs.size());
+    assign_range(rhs, 0, rhs.size());
+    return *this;
+  }
+
+  // Like operator= but chunks of the range are evaluated concurrently on
+  // executor, so distinct indices must not write the same element and rhs
+  // must not read an element another chunk writes, as x = x[idx] would.
+  // The first exception of a chunk is rethrown once all chunks are done
+  template <typename T2, typename Rep2, typename Executor>
+  Array& assign_parallel(const Array<T2, Rep2>& rhs, Executor& executor) {
+    assert(size() == rhs.size());
+    // 32 KiB of results per chunk stays in L1, whole packets leave only the
+    // last chunk a scalar tail
+    constexpr std::size_t n = Packet<T>::size;
+    constexpr std::size_t chunk =
+        std::max<std::size_t>(32 * 1024 / sizeof(T) / n, 1) * n;
+    const std::size_t chunks = (rhs.size() + chunk - 1) / chunk;
+    std::latch done(static_cast<std::ptrdiff_t>(chunks));
+    std::mutex m;
+    std::exception_ptr error;
+    std::size_t c = 0;
+    try {
+      for (; c < chunks; ++c) {
+        executor.Submit([this, &rhs, &done, &m, &error, c] {
+          // a throwing chunk still counts down, or the wait below hangs
+          struct CountDown {
+            std::latch& done;
+            ~CountDown() { done.count_down(); }
+          } count_down{done};
+          try {
+            assign_range(rhs, c * chunk,
+                         std::min(rhs.size(), (c + 1) * chunk));
+          } catch (...) {
+            std::lock_guard<std::mutex> l(m);
+            if (!error) {
+              error = std::current_exception();
+            }
+          }
+        });
+      }
+    } catch (...) {
+      // the submitted chunks still refer to the locals above
+      done.count_down(static_cast<std::ptrdiff_t>(chunks - c));
+      done.wait();
+      throw;
+    }
+    done.wait();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return *this;
+  }
+
+  std::size_t size() const { return r_.size(); }
+
+  T& operator[](std::size_t i) {
+    assert(i < size());
+    return r_[i];
+  }
+
+  decltype(auto) operator[](std::size_t i) const {
+    assert(i < size());
+    return r_[i];
+  }
+
+  template <typename T2, typename Rep2>
+  Array<T, A_Subscript<T, Rep, Rep2>> operator[](const Array<T2, Rep2>& rhs) {
+    return Array<T, A_Subscript<T, Rep, Rep2>>{
+        A_Subscript<T, Rep, Rep2>{this->rep(), rhs.rep()}};
+  }
+
+  template <typename T2, typename Rep2>
+  decltype(auto) operator[](const Array<T2, Rep2>& rhs) const {
+    return Array<T, A_Subscript<T, Rep, Rep2>>{
+        A_Subscript<T, Rep, Rep2>{this->rep(), rhs.rep()}};
+  }
+
+  Rep& rep() { return r_; }
+
+  const Rep& rep() const { return r_; }
+
+ private:
+  template <typename T2, typename Rep2>
+  void assign_range(const Array<T2, Rep2>& rhs, std::size_t i,
+                    std::size_t last) {
+    if constexpr (std::is_same_v<T, T2> && HasStorePacket<Rep>::value &&
+                  HasLoadPacket<Rep2>::value) {
+      // whole packets without the bounds checks of operator[], then the tail
+      constexpr std::size_t n = Packet<T>::size;
+      for (; i + n <= last; i += n) {
+        r_.store_packet(i, rhs.rep().load_packet(i));
+      }
+    }
+    for (; i < last; ++i) {
+      r_[i] = rhs.rep()[i];
+    }
+  }
+
+ private:
+  Rep r_;
+};
+
+template <typename T, typename R1, typename R2>
+Array<T, A_Add<T, R1, R2>> operator+(const Array<T, R1>& lhs,
+                                     const Array<T, R2>& rhs) {
+  return Array<T, A_Add<T, R1, R2>>{A_Add<T, R1, R2>{lhs.rep(), rhs.rep()}};
+}
+
+template <typename T, typename R1, typename R2>
+Array<T, A_Mult<T, R1, R2>> operator*(const Array<T, R1>& lhs,
+                                      const Array<T, R2>& rhs) {
+  return Array<T, A_Mult<T, R1, R2>>{A_Mult<T, R1, R2>{lhs.rep(), rhs.rep()}};
+}
+
+template <typename T, typename R2>
+Array<T, A_Mult<T, A_Scalar<T>, R2>> operator*(const T& lhs,
+                                               const Array<T, R2>& rhs) {
+  return Array<T, A_Mult<T, A_Scalar<T>, R2>>{
+      A_Mult<T, A_Scalar<T>, R2>{A_Scalar<T>(lhs), rhs.rep()}};
+}
+
+}  // namespace jc::test
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "expression_template.hpp"
+#include "thread_pool.hpp"
+
+namespace jc::benchmark {
+
+// Wall time of f in seconds
+template <typename F>
+double Seconds(F&& f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const auto finish = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(finish - start).count();
+}
+
+// SArray without load_packet() and store_packet(), so Array::operator=
+// takes the element by element path
+template <typename T>
+class ScalarSArray {
+ public:
+  explicit ScalarSArray(std::size_t sz) : a_(sz) {}
+
+  std::size_t size() const { return a_.size(); }
+
+  T& operator[](std::size_t i) { return a_[i]; }
+
+  const T& operator[](std::size_t i) const { return a_[i]; }
+
+ private:
+  SArray<T> a_;
+};
+
+// Best time per element of assign over about 100M elements in total, y is
+// -0.2 so x = 1.2 * x + x * y keeps x near its start value
+template <typename F>
+double NsPerElement(std::size_t sz, F&& assign) {
+  const std::size_t rounds = std::max<std::size_t>(100000000 / sz / 5, 1);
+  double best = 1e9;
+  for (int i = 0; i < 5; ++i) {
+    best = std::min(best, Seconds([&] {
+                      for (std::size_t r = 0; r < rounds; ++r) {
+                        assign();
+                      }
+                    }));
+  }
+  return best * 1e9 / static_cast<double>(rounds * sz);
+}
+
+// x = 1.2 * x + x * y through the packet path of Array, through Array over
+// ScalarSArray with packets disabled, and as a hand written loop
+void AssignExpression(std::size_t sz) {
+  test::Array<double> x{sz};
+  test::Array<double> y{sz};
+  test::Array<double, ScalarSArray<double>> scalar_x{sz};
+  test::Array<double, ScalarSArray<double>> scalar_y{sz};
+  std::vector<double> loop_x(sz, 1);
+  std::vector<double> loop_y(sz, -0.2);
+  for (std::size_t i = 0; i < sz; ++i) {
+    x[i] = scalar_x[i] = 1;
+    y[i] = scalar_y[i] = -0.2;
+  }
+  const auto print = [&](const char* variant, double ns) {
+    std::printf(
+        "{\"benchmark\":\"assign\",\"expression\":\"1.2*x+x*y\","
+        "\"variant\":\"%s\",\"elements\":%zu,\"ns_per_element\":%.3f}\n",
+        variant, sz, ns);
+  };
+  print("packet", NsPerElement(sz, [&] { x = 1.2 * x + x * y; }));
+  print("scalar", NsPerElement(sz, [&] {
+          scalar_x = 1.2 * scalar_x + scalar_x * scalar_y;
+        }));
+  print("hand_loop", NsPerElement(sz, [&] {
+          for (std::size_t i = 0; i < sz; ++i) {
+            loop_x[i] = 1.2 * loop_x[i] + loop_x[i] * loop_y[i];
+          }
+        }));
+  for (std::size_t i = 0; i < sz; ++i) {
+    assert(x[i] > 0.5 && x[i] < 2);
+    assert(scalar_x[i] > 0.5 && scalar_x[i] < 2);
+    assert(loop_x[i] > 0.5 && loop_x[i] < 2);
+  }
+}
+
+// assign_parallel() of the same expression on pools of 1 to 16 threads,
+// speedup is against the serial operator=, which only shows on as many
+// cores as threads and flattens once memory bandwidth is the limit
+void AssignParallelScaling(std::size_t sz) {
+  test::Array<double> x{sz};
+  test::Array<double> y{sz};
+  for (std::size_t i = 0; i < sz; ++i) {
+    x[i] = 1;
+    y[i] = -0.2;
+  }
+  const double serial = NsPerElement(sz, [&] { x = 1.2 * x + x * y; });
+  for (std::size_t threads : {1, 2, 4, 8, 16}) {
+    ThreadPool pool{threads};
+    const double ns =
+        NsPerElement(sz, [&] { x.assign_parallel(1.2 * x + x * y, pool); });
+    std::printf(
+        "{\"benchmark\":\"assign_parallel\",\"elements\":%zu,"
+        "\"threads\":%zu,\"hardware_threads\":%u,\"ns_per_element\":%.3f,"
+        "\"speedup\":%.2f}\n",
+        sz, threads, std::thread::hardware_concurrency(), ns, serial / ns);
+  }
+  for (std::size_t i = 0; i < sz; ++i) {
+    assert(x[i] > 0.5 && x[i] < 2);
+  }
+}
+
+}  // namespace jc::benchmark
+
+int main() {
+  // in L1, in L2 and in memory
+  for (std::size_t sz : {1000, 30000, 10000000}) {
+    jc::benchmark::AssignExpression(sz);
+  }
+  for (std::size_t sz : {1000000, 10000000}) {
+    jc::benchmark::AssignParallelScaling(sz);
+  }
+}
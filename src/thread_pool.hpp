@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace jc {
+
+// Work-stealing thread pool: each worker owns a deque, pops its own tasks
+// LIFO and steals from the front of other workers' deques when idle. Tasks
+// submitted from a worker go to that worker's deque.
+class ThreadPool {
+ public:
+  explicit ThreadPool(std::size_t n = std::thread::hardware_concurrency()) {
+    n = n == 0 ? 1 : n;
+    for (std::size_t i = 0; i < n; ++i) {
+      queues_.emplace_back(std::make_unique<Queue>());
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      workers_.emplace_back([this, i] { Run(i); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> l(m_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& t : workers_) {
+      t.join();
+    }
+  }
+
+  void Submit(std::function<void()> task) {
+    const std::size_t i = current_pool_ == this
+                              ? current_index_
+                              : next_.fetch_add(1) % queues_.size();
+    // count the task before any worker can pop it, Run() decrements after
+    {
+      std::lock_guard<std::mutex> l(m_);
+      ++pending_;
+    }
+    {
+      std::lock_guard<std::mutex> l(queues_[i]->m);
+      queues_[i]->tasks.emplace_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+
+  std::size_t Size() const { return workers_.size(); }
+
+  // co_await pool.Schedule() resumes the coroutine on a worker
+  auto Schedule() {
+    struct Awaiter {
+      ThreadPool* pool;
+
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<> h) {
+        pool->Submit([h] { h.resume(); });
+      }
+
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{this};
+  }
+
+ private:
+  struct Queue {
+    std::mutex m;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void Run(std::size_t i) {
+    current_pool_ = this;
+    current_index_ = i;
+    while (true) {
+      std::function<void()> task;
+      if (Pop(i, &task) || Steal(i, &task)) {
+        --pending_;
+        task();
+        continue;
+      }
+      std::unique_lock<std::mutex> l(m_);
+      cv_.wait(l, [&] { return stop_ || pending_ > 0; });
+      if (stop_ && pending_ == 0) {
+        return;
+      }
+    }
+  }
+
+  bool Pop(std::size_t i, std::function<void()>* task) {
+    std::lock_guard<std::mutex> l(queues_[i]->m);
+    if (queues_[i]->tasks.empty()) {
+      return false;
+    }
+    *task = std::move(queues_[i]->tasks.back());
+    queues_[i]->tasks.pop_back();
+    return true;
+  }
+
+  bool Steal(std::size_t i, std::function<void()>* task) {
+    for (std::size_t j = 1; j < queues_.size(); ++j) {
+      Queue& q = *queues_[(i + j) % queues_.size()];
+      std::lock_guard<std::mutex> l(q.m);
+      if (!q.tasks.empty()) {
+        *task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex m_;
+  std::condition_variable cv_;
+  std::atomic<std::size_t> pending_ = 0;
+  std::atomic<std::size_t> next_ = 0;
+  bool stop_ = false;
+  inline static thread_local ThreadPool* current_pool_ = nullptr;
+  inline static thread_local std::size_t current_index_ = 0;
+};
+
+}  // namespace jc